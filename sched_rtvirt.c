@@ -18,8 +18,10 @@
 #include <xen/sched-if.h>
 #include <xen/timer.h>
 #include <xen/softirq.h>
+#include <xen/tasklet.h>
 #include <xen/time.h>
 #include <xen/errno.h>
+#include <xen/trace.h>
 
 #ifndef NDEBUG
 #define CHECK(_p)                                           \
@@ -46,23 +48,67 @@
 #define SC_UPDATE_DEADL	(2048) // VCPU is running sporadic task
 #define SC_ARRIVED	(4096) // VCPU is running sporadic task
 #define SC_WOKEN	(8192) // VCPU is running sporadic task
-#define SC_CPU0_BUSY	(16384) // VCPU is running sporadic task
 
 #define EXTRA_QUANTUM (MICROSECS(200))
 
-#define DEBUG_LINES   (50000)
+/*
+ * Defaults of the timing constants sc_calibrate() derives for the host, see
+ * struct sc_priv_info
+ */
+#define SC_MIN_GLOBAL_SLICE	(MICROSECS(250))
+#define SC_SHIFT_DELAY		(MICROSECS(15))
+#define SC_FULL_SLACK		1000
+/* Global boundaries a calibration run samples */
+#define SC_CALIBRATE_BOUNDARIES	256
+/* Calibrated constants keep what they cost under 1/SC_OVERHEAD_RATIO of the time */
+#define SC_OVERHEAD_RATIO	50
+
+/* Weight 1/2^SC_COST_SHIFT of a new sample in a switch cost, see sc_context_saved() */
+#define SC_COST_SHIFT	3
+/* A switch that took longer than this was held up by an interrupt, not the switch */
+#define SC_COST_MAX	(MICROSECS(100))
+
+/*
+ * xentrace events (xentrace -e 0x22000), sim/rtvirt_trace.c decodes them.
+ * Every event starts with domain id and VCPU id, except BOUNDARY, REPLAN
+ * and REFUSE.
+ */
+#ifndef TRC_SCHED_RTVIRT
+#define TRC_SCHED_RTVIRT	6
+#endif
+#define TRC_RTVIRT_BOUNDARY	TRC_SCHED_CLASS_EVT(RTVIRT, 1) // slice length, deadline lo/hi, shift
+#define TRC_RTVIRT_SLICE	TRC_SCHED_CLASS_EVT(RTVIRT, 2) // offset, length, other side
+#define TRC_RTVIRT_MIGRATE	TRC_SCHED_CLASS_EVT(RTVIRT, 3) // from cpu, to cpu
+#define TRC_RTVIRT_SKIP		TRC_SCHED_CLASS_EVT(RTVIRT, 4) // how late
+#define TRC_RTVIRT_ARRIVE	TRC_SCHED_CLASS_EVT(RTVIRT, 5) // time left in the slice
+#define TRC_RTVIRT_EXHAUST	TRC_SCHED_CLASS_EVT(RTVIRT, 6) // overrun, local slice
+#define TRC_RTVIRT_REPLAN	TRC_SCHED_CLASS_EVT(RTVIRT, 7) // VCPUs moved, VCPUs placed
+#define TRC_RTVIRT_REFUSE	TRC_SCHED_CLASS_EVT(RTVIRT, 8) // requested, left, guest CPUs
+
+/* Records per CPU in the trace ring, must be a power of two */
+#define SC_TRACE_RECS   (4096)
+/* Records the drain tasklet prints per CPU before giving others a go */
+#define SC_TRACE_BATCH  (256)
+/* Slots laid out per CPU and global slice, VCPUs past them dispatch from runq */
+#define SC_SLOTS        (32)
 
 #define DEFAULT_PERIOD (MILLISECS(1000))
 #define DEFAULT_SLICE (MILLISECS(150))
 
 extern int sc_debugging;
 
+/* Calibrate the timing constants as soon as the scheduler is up */
+static bool_t __read_mostly sched_sc_calibrate = 0;
+boolean_param("sched_sc_calibrate", sched_sc_calibrate);
+
 #define DOM0_PERIOD (MILLISECS(1000))
 #define DOM0_SLICE (MILLISECS(1000))
 
 #define PERIOD_MAX MILLISECS(10000) /* 10s  */
 #define PERIOD_MIN (MICROSECS(11))  /* 10us */
 #define SLICE_MIN (MICROSECS(5))    /*  5us */
+/* task_slice.time that arms no timer at all */
+#define SC_NO_TIMER (-1)
 
 #define IMPLY(a, b) (!(a) || (b))
 #define EQ(a, b) ((!!(a))== (!!(b)))
@@ -115,10 +161,52 @@ extern int sc_debugging;
 struct sc_barrier_t {
     atomic_t cpu_count;
     atomic_t updating_global_deadline;
+    /* Bumped to odd by the CPU computing a boundary, to even when published */
+    unsigned long epoch;
 };
 
 struct sc_dom_info {
     struct domain  *domain;
+    /* Bandwidth changes taken in, and the last one in force */
+    uint32_t requested;
+    uint32_t done;
+    /* On prv->notify_pending while a change waits for a repartition */
+    struct list_head pending_elem;
+    /* On prv->notify_list until sc_notify_tasklet() sent the VIRQ */
+    struct list_head notify_elem;
+};
+
+/* Deadline-ordered min-heap of VCPUs, see "Priority Queue" below */
+struct sc_heap {
+    struct sc_vcpu_info **nodes;
+    int size;
+    int capacity;
+};
+
+/*
+ * One DP-Wrap partition of the CPUs: how much of its hyper-period every CPU
+ * has handed out. The per-VCPU half of a plan lives in each VCPU's
+ * next_assign until the plan is published.
+ */
+struct sc_plan {
+    /* prv->plan_version this plan was built from */
+    unsigned long version;
+    unsigned long long hyper_slice[NR_CPUS];
+    unsigned long long hyper_period[NR_CPUS];
+    /*
+     * Order the CPUs are filled in, see sc_plan_order(): fill[r] is the
+     * r-th CPU and rank[cpu] its position. Only the first nr_cpus ranks are
+     * the instance's own CPUs.
+     */
+    int fill[NR_CPUS];
+    int rank[NR_CPUS];
+    unsigned int nr_cpus;
+    /* Ranks of the CPUs whose hyper_slice is still short of their hyper_period */
+    cpumask_t room;
+    /* Bandwidth every VCPU gets on top of its own to be switched in, see sc_plan_bw() */
+    s_time_t overhead;
+    /* Room at or below which a CPU in use counts as full, see sc_plan_full() */
+    s_time_t full;
 };
 
 struct sc_priv_info {
@@ -126,12 +214,106 @@ struct sc_priv_info {
     spinlock_t lock;
     struct sc_barrier_t cpu_barrier;
     int       status;
+    /* VCPUs with a deadline, earliest first */
+    struct sc_heap deadline_heap;
+    int       nr_vcpus;
+    /* Sum of the bw of every guest VCPU, in 1/100000 of a CPU */
+    s_time_t  bw_admitted;
+    /*
+     * The current global slice runs from global_slice_start to
+     * global_deadline. Only the CPU computing a boundary writes them, and
+     * reverse_order_next, see global_deadline_barrier().
+     */
+    s_time_t  global_slice_start;
+    s_time_t  global_deadline;
+    int       reverse_order_next;
+    /* Highest CPU a guest VCPU was put on */
+    int       last_assigned_pcpu;
+    /*
+     * CPUs to send an IPI once the boundary being computed is published:
+     * those waiting for it and those it moved VCPUs to, see sc_kick().
+     */
+    cpumask_t kick;
+    /* CPUs dom0 keeps to itself, the first in the fill order */
+    int       dom0_cpu_count;
+    /* CPUs of this instance, those on cpus */
+    cpumask_t cpumask;
+    /* Every guest VCPU, in the order the CPUs are filled in */
+    struct list_head sc_list_head;
+    /* Guest VCPUs admitted and the sum of their rate, see sc_overhead() */
+    int       nr_admitted;
+    s_time_t  rate_admitted;
+    /*
+     * Timing constants, set through sysctl or derived by sc_calibrate():
+     * the shortest global slice, how long a boundary waits for the CPUs when
+     * a repartition is pending, the room (1/100000 CPU) at or below which a
+     * CPU counts as full, and how long an idle CPU goes between looks.
+     */
+    s_time_t  min_global_slice;
+    s_time_t  shift_delay;
+    s_time_t  full_slack;
+    s_time_t  extra_quantum;
+    /* Boundaries the calibration run still samples, 0 if none is running */
+    int       calibrating;
+    /* How late the boundaries sampled were published */
+    s_time_t  barrier_cost;
+    /*
+     * plan points at the partition in use and shadow at the next one, the
+     * third entry of plans is where sc_plan_build() works. plan_version
+     * changes whenever something the partition depends on does.
+     */
+    struct sc_plan plans[3];
+    struct sc_plan *plan;
+    struct sc_plan *shadow;
+    unsigned long plan_version;
+    /* Copy of the guest VCPUs sc_plan_build() works on, see sc_plan_snapshot() */
+    struct sc_plan_vcpu *plan_vcpus;
+    int       plan_capacity;
+    /* Rank of the first CPU whose share of the plan in use is out of date */
+    int plan_from;
+    /* The CPUs or dom0's share of them changed since the fill order was set */
+    int plan_reorder;
+    /* VCPUs the last plan published moved to other CPUs */
+    unsigned int plan_moved;
+    /* Scratch for sc_plan_sort() */
+    struct list_head plan_order[NR_CPUS];
+    struct tasklet plan_tasklet;
+    /* sc_cpu_info of every CPU this instance has allocated */
+    struct list_head cpus;
+    /* Allocated the first time tracing is switched on, see sc_trace_start() */
+    struct sc_trace_ring *trace[NR_CPUS];
+    struct tasklet trace_tasklet;
+    /* Domains with a change staged, and ones to tell it is in force */
+    struct list_head notify_pending;
+    struct list_head notify_list;
+    struct tasklet notify_tasklet;
+};
+
+/* Where dp_wrap_place() put a VCPU */
+struct sc_assignment {
+    int placed;
+    int split;
+    int processor_a;
+    int processor_b;
+    s_time_t period_a;
+    s_time_t slice_a;
+    s_time_t period_b;
+    s_time_t slice_b;
+};
+
+/* A guest VCPU as sc_plan_build() sees it, without prv->lock */
+struct sc_plan_vcpu {
+    struct sc_vcpu_info *inf;
+    /* Bandwidth it asked for, without the plan's overhead */
+    s_time_t bw;
+    int admitted;
+    struct sc_assignment assign;
+    struct sc_assignment next_assign;
 };
 
 struct sc_vcpu_info {
     struct vcpu *vcpu;
     struct list_head list;
-    struct list_head d_list;
     struct list_head sc_list;
     /* Parameters for EDF */
     s_time_t  period;  /* = relative deadline */
@@ -158,6 +340,23 @@ struct sc_vcpu_info {
     s_time_t  period_temp;
     s_time_t  slice_temp;
 
+    /* The three bandwidths above as Q32 fractions, see sc_update_shares() */
+    u64       share_new;
+    u64       share_a;
+    u64       share_b;
+
+    /* Placement in the plan in use, and in the shadow plan */
+    struct sc_assignment assign;
+    struct sc_assignment next_assign;
+    /* Bandwidth next_assign places it with, see sc_plan_bw() */
+    s_time_t  next_bw;
+    /* Bandwidth admitted for it, see sc_admit() */
+    s_time_t  bw;
+    /* Global boundaries a second its deadlines can bring, see sc_rate() */
+    s_time_t  rate;
+    /* CPU it last ran on, -1 before it ever ran */
+    int       last_cpu;
+
     /* Status of domain */
     int       status;
     int       latency;
@@ -166,6 +365,7 @@ struct sc_vcpu_info {
     int       extratime;
     /* Bookkeeping */
     s_time_t  deadl_abs;
+    int       heap_index;   /* slot in deadline_heap, -1 if not queued */
     s_time_t  sched_start_abs;
     s_time_t  cputime;
     s_time_t  local_cputime;
@@ -177,183 +377,284 @@ struct sc_vcpu_info {
 
 /*	Priority Queue		*/
 
-#define MAX_VCPUs 128
-
-struct heap_node {
-    struct sc_vcpu_info * data;
-    unsigned long long key;
-};
-
-struct heap_node MIN_HEAP[MAX_VCPUs];
-
 /*
- * Initial heap size 0 as heap is empty
+ * Min-heap of VCPUs ordered by deadl_abs. The heap is intrusive: every
+ * sc_vcpu_info remembers its own slot in heap_index (-1 when it is not
+ * queued), so removing a VCPU or updating its deadline never has to search
+ * for it. The node array belongs to the scheduler instance and is grown in
+ * sc_alloc_vdata, outside of any lock, so it always has room for every VCPU
+ * the instance knows about.
  */
-int heapsize = 0;
+
+#define SC_HEAP_MIN_CAPACITY 64
 
 /*
  * Find the parent node
  */
-int parent(int i){
+static inline int parent(int i){
     return (i - 1) / 2;
 }
 
-void swap(struct heap_node *n1, struct heap_node *n2) {
-    struct heap_node temp = *n1 ;
-    *n1 = *n2 ;
-    *n2 = temp ;
+static inline void heapSet(struct sc_heap *h, int i, struct sc_vcpu_info *inf)
+{
+    h->nodes[i] = inf;
+    inf->heap_index = i;
 }
 
 /*
- * Use for heap insert and decrease key
- * In if condition check if user attempted to increase value instead of decrease
- * Compare child with parent, if child is smaller then swap
- * Now mark that child and apply the same logic until it reaches root node
+ * Move the node at i towards the root while its parent has a later deadline
  */
-void decreaseKey(int i){
-    while(i > 0 && MIN_HEAP[parent(i)].key > MIN_HEAP[i].key){
-        swap(&MIN_HEAP[i], &MIN_HEAP[parent(i)]);
-        i = parent(i);
+static void heapSiftUp(struct sc_heap *h, int i)
+{
+    struct sc_vcpu_info *inf = h->nodes[i];
+
+    while(i > 0 && h->nodes[parent(i)]->deadl_abs > inf->deadl_abs)
+    {
+	heapSet(h, i, h->nodes[parent(i)]);
+	i = parent(i);
     }
+
+    heapSet(h, i, inf);
 }
 
 /*
- * Search for a specific node to change its value
- * Returns the index the node being searched
+ * Move the node at i towards the leaves while a child has an earlier deadline
  */
-int searchIndex(struct sc_vcpu_info *vcpu){
-    for(int i = 0; i < heapsize; ++i){
-        if(MIN_HEAP[i].data == vcpu)
-            return i;
+static void heapSiftDown(struct sc_heap *h, int i)
+{
+    struct sc_vcpu_info *inf = h->nodes[i];
+    int child;
+
+    while((child = 2*i + 1) < h->size)
+    {
+	if(child + 1 < h->size &&
+		h->nodes[child + 1]->deadl_abs < h->nodes[child]->deadl_abs)
+	    child++;
+
+	if(h->nodes[child]->deadl_abs >= inf->deadl_abs)
+	    break;
+
+	heapSet(h, i, h->nodes[child]);
+	i = child;
     }
-    printk("--- Oops! BUG in searchIndex ---\n");
-    return heapsize;
+
+    heapSet(h, i, inf);
 }
 
 /*
- * Called initially to create a min heap
- * Also called after a node extraction from min heap
- * Since the smallest value node is at the root of min heap
- * After extraction min heapify is called on root node
- * It compares parent with its children
- * If a smaller child found then its swapped with parent and
- * Min heapify is again called on that child to apply same procedure
+ * Make sure the heap can hold count nodes. Allocates, so it must not be
+ * called with the scheduler lock held; lock is only taken to swap arrays.
  */
-void minHeapify(int i){
-    int largest, r;
-
-    int l = 2*i +1;
+static int heapReserve(struct sc_heap *h, spinlock_t *lock, int count)
+{
+    struct sc_vcpu_info **nodes, **old;
+    unsigned long flags;
+    int capacity;
 
-    if (l < heapsize && MIN_HEAP[l].key < MIN_HEAP[i].key)
-        largest = l;
-    else
-        largest = i;
+    if(count <= h->capacity)
+	return 0;
 
-    r = 2*i +2;
+    capacity = (h->capacity ? h->capacity : SC_HEAP_MIN_CAPACITY);
+    while(capacity < count)
+	capacity *= 2;
 
-    if (r < heapsize && MIN_HEAP[r].key < MIN_HEAP[largest].key)
-        largest = r;
+    nodes = xzalloc_array(struct sc_vcpu_info *, capacity);
+    if(nodes == NULL)
+	return -ENOMEM;
 
-    if (largest != i){
-        swap(&MIN_HEAP[i], &MIN_HEAP[largest]);
-        minHeapify(largest);
+    spin_lock_irqsave(lock, flags);
+    if(capacity > h->capacity)
+    {
+	memcpy(nodes, h->nodes, h->size * sizeof(*nodes));
+	old = h->nodes;
+	h->nodes = nodes;
+	h->capacity = capacity;
     }
-}
+    else
+	old = nodes;
+    spin_unlock_irqrestore(lock, flags);
 
-/*
- * Increase heap size to create space for new node
- * Insert the node at that space by calling decrease key function
- */
-void heapInsert(struct sc_vcpu_info * vcpu){
-    ++heapsize;
-    MIN_HEAP[heapsize - 1].key = vcpu->deadl_abs;
-    MIN_HEAP[heapsize - 1].data = vcpu;
+    xfree(old);
+    return 0;
+}
 
-    decreaseKey(heapsize - 1);
+static inline struct sc_vcpu_info *heapMin(struct sc_heap *h)
+{
+    return (h->size ? h->nodes[0] : NULL);
 }
 
 /*
- * Heap size less than zero mean no items in heap so nothing to extract
- * For min heap minimum value is at the root which in here is A[0]
- * Save the root and replace root with last element in the heap and decrease the heap size
- * So the root is still in the array in last position but no longer in the heap
- * Since the last element is now the root the heap may be unbalanced
- * So to balance the heap call min heapify on the root node again
- * Lastly return the saved root
+ * The runner-up of a binary min-heap is always one of the root's children
  */
-void extractMin(void){
-    if(heapsize < 0)
-        printk("Heap Underflow\n");
+static inline struct sc_vcpu_info *heapSecond(struct sc_heap *h)
+{
+    if(h->size < 2)
+	return NULL;
+
+    if(h->size > 2 && h->nodes[2]->deadl_abs < h->nodes[1]->deadl_abs)
+	return h->nodes[2];
 
-    MIN_HEAP[0].key = MIN_HEAP[heapsize - 1].key;
-    MIN_HEAP[0].data = MIN_HEAP[heapsize - 1].data;
-    --heapsize;
-    minHeapify(0);
+    return h->nodes[1];
 }
 
-void deleteNode(struct sc_vcpu_info *vcpu){
-	int i;
+static void heapInsert(struct sc_heap *h, struct sc_vcpu_info *inf)
+{
+    if(inf->heap_index >= 0)
+	return;
+
+    if(h->size == h->capacity)
+    {
+	printk("--- Oops! BUG in heapInsert: heap full (%d) ---\n", h->capacity);
+	return;
+    }
 
-	i = searchIndex(vcpu);
-	MIN_HEAP[i].key = 0;
-	decreaseKey(i);
-	extractMin();
+    heapSet(h, h->size++, inf);
+    heapSiftUp(h, inf->heap_index);
 }
 
-void updateMin(struct sc_vcpu_info *vcpu){
+static void heapDelete(struct sc_heap *h, struct sc_vcpu_info *inf)
+{
+    struct sc_vcpu_info *last;
+    int i = inf->heap_index;
+
+    if(i < 0)
+	return;
+
+    inf->heap_index = -1;
+    last = h->nodes[--h->size];
+
+    if(last == inf)
+	return;
 
-	if(MIN_HEAP[0].data != vcpu)
-		printk("-- Mismatched data and vcpu -- %d - %llu - %d - %llu \n",
-			MIN_HEAP[0].data->vcpu->domain->domain_id,
-			MIN_HEAP[0].key,
-			vcpu->vcpu->domain->domain_id,
-			(unsigned long long ) vcpu->deadl_abs);
+    heapSet(h, i, last);
+    heapSiftUp(h, i);
+    heapSiftDown(h, last->heap_index);
+}
+
+/*
+ * Restore the heap order after inf->deadl_abs changed, in either direction
+ */
+static void heapUpdate(struct sc_heap *h, struct sc_vcpu_info *inf)
+{
+    if(inf->heap_index < 0)
+	return;
 
-	MIN_HEAP[0].key = vcpu->deadl_abs;
-	minHeapify(0);
+    heapSiftUp(h, inf->heap_index);
+    heapSiftDown(h, inf->heap_index);
 }
 
 /*	END: Priority Queue 	*/
-struct vm_debug_entry {
-    int domid;
-    int vcpuid;
-    s_time_t now_time;
-    long int ret_time;
-    long int slice_time;
-    s_time_t alloc;
+/*
+ * Tracing: while sc_debugging == 1 every CPU appends a binary record to its
+ * own ring at each global boundary and each pick. Each ring has exactly one
+ * writer (its CPU, under its schedule lock) and one reader (the drain
+ * tasklet), so neither side takes a lock. A full ring drops new records and
+ * counts them rather than waiting for the reader.
+ */
+#define SC_TRC_BOUNDARY	1
+#define SC_TRC_PICK	2
+
+struct sc_trace_rec {
+    s_time_t stamp;
+    uint16_t event;
+    uint16_t domid;
+    uint32_t vcpuid;
+    /* ns, saturated to 32 bits */
+    uint32_t ret_time;	// pick: time granted
+    uint32_t cputime;	// pick: local cputime, boundary: slice length
+    uint32_t alloc;	// pick: time since the last pick, boundary: time handed out
+    uint32_t cost;	// pick: time spent in sc_do_schedule()
+};
+
+struct sc_trace_ring {
+    /* owning CPU only */
+    unsigned int head;
+    unsigned int dropped;
+    domid_t last_domid;
+    /* drain tasklet only */
+    unsigned int tail;
+    unsigned int dropped_seen;
+    struct sc_trace_rec recs[SC_TRACE_RECS];
+};
+
+/* Where a VCPU runs on a CPU within the current global slice */
+struct sc_slot {
+    struct sc_vcpu_info *inf;
+    s_time_t offset;	/* from slot_start */
+    s_time_t length;
 };
 
 struct sc_cpu_info {
+    struct list_head cpu_elem;
     struct list_head runnableq;
     struct list_head waitq;
     struct list_head inactiveq;
     struct list_head migratedq;
     s_time_t current_slice_expires;
     s_time_t allocated_time;
-    unsigned long long hyper_slice;
-    unsigned long long hyper_period;
     unsigned long long used_slice;
     unsigned long long used_period;
     unsigned long long new_gl_d;
-    int d_array_index;
-    int print_index;
-    struct vm_debug_entry d_array[DEBUG_LINES];
+    /* CPU after this one in the fill order, a sporadic VCPU spills onto it */
+    int fill_next;
+    /*
+     * Measured cost of a switch to a VCPU that last ran on this CPU, and to
+     * one that comes from another, see sc_context_saved()
+     */
+    s_time_t switch_cost;
+    s_time_t handoff_cost;
+    /* Measured cost of sc_do_schedule(), sampled while calibrating */
+    s_time_t sched_cost;
+    /*
+     * Layout of the current global slice in runq order, see
+     * calculate_new_local_deadlines(). slot_next is the first slot that
+     * has not ended yet, see sc_slot_current().
+     */
+    s_time_t slot_start;
+    int nr_slots;
+    int slot_next;
+    struct sc_slot slots[SC_SLOTS];
 };
 
 #define SC_PRIV(_ops) \
     ((struct sc_priv_info *)((_ops)->sched_data))
+
+/*
+ * No queue can hold more than every VCPU of the instance, so a walk that
+ * visits more entries than that has gone round a corrupted list.
+ */
+#define SC_LIST_CORRUPT(prv, visited) \
+    unlikely((visited) > (prv)->nr_vcpus)
 #define EDOM_INFO(d)   ((struct sc_vcpu_info *)((d)->sched_priv))
 #define CPU_INFO(cpu)  \
     ((struct sc_cpu_info *)per_cpu(schedule_data, cpu).sched_priv)
 #define LIST(d)        (&EDOM_INFO(d)->list)
-#define D_LIST(d)      (&EDOM_INFO(d)->d_list)
 #define SC_LIST(d)     (&EDOM_INFO(d)->sc_list)
 #define RUNQ(cpu)      (&CPU_INFO(cpu)->runnableq)
 #define WAITQ(cpu)     (&CPU_INFO(cpu)->waitq)
 #define INACTIVEQ(cpu) (&CPU_INFO(cpu)->inactiveq)
 #define MIGQ(cpu) (&CPU_INFO(cpu)->migratedq)
-#define HSLICE(cpu)    (CPU_INFO(cpu)->hyper_slice)
-#define HPERIOD(cpu)   (CPU_INFO(cpu)->hyper_period)
+#define HSLICE(plan, cpu)    ((plan)->hyper_slice[cpu])
+#define HPERIOD(plan, cpu)   ((plan)->hyper_period[cpu])
+
+/* Only write a plan's slice/period through here, it keeps room in sync */
+static inline void sc_plan_set(struct sc_plan *plan, int cpu,
+	unsigned long long slice, unsigned long long period)
+{
+    HSLICE(plan, cpu) = slice;
+    HPERIOD(plan, cpu) = period;
+
+    if(slice == period)
+	cpumask_clear_cpu(plan->rank[cpu], &plan->room);
+    else
+	cpumask_set_cpu(plan->rank[cpu], &plan->room);
+}
+
+/* Too little is left of cpu for a slice worth switching to */
+static inline int sc_plan_full(struct sc_plan *plan, int cpu)
+{
+    return HSLICE(plan, cpu) != 0 && HSLICE(plan, cpu) + plan->full >= HPERIOD(plan, cpu);
+}
 #define USEDSLICE(cpu)    (CPU_INFO(cpu)->used_slice)
 #define USEDPERIOD(cpu)   (CPU_INFO(cpu)->used_period)
 #define IDLETASK(cpu)  (idle_vcpu[cpu])
@@ -362,6 +663,125 @@ struct sc_cpu_info {
 
 #define DIV_UP(x,y) (((x) + (y) - 1) / y)
 
+/*
+ * Bandwidths are kept as Q32 fractions so that turning one into a length
+ * of time at every boundary is a multiply and a shift instead of a 64-bit
+ * division. A share is rounded down, so a VCPU never gets more than it
+ * reserved; the result is at most 1ns short of slice * len / period.
+ */
+static inline u64 sc_share(s_time_t slice, s_time_t period)
+{
+    // slice <= period, so dropping the same low bits of both keeps the
+    // ratio and the shift below from overflowing
+    while((u64)slice >> 32)
+    {
+	slice >>= 1;
+	period >>= 1;
+    }
+
+    if(period <= 0)
+	return 0;
+
+    return ((u64)slice << 32) / period;
+}
+
+/* share * len, with len split in halves so nothing overflows 64 bits */
+static inline s_time_t sc_scale(u64 share, s_time_t len)
+{
+    u64 hi, lo;
+
+    // Rounds towards zero for a len that is already behind us, like the
+    // division it replaces
+    if(len < 0)
+	return -sc_scale(share, -len);
+
+    hi = (u64)len >> 32;
+    lo = (u64)len & 0xffffffffULL;
+
+    return (s_time_t)(share * hi + ((share * lo) >> 32));
+}
+
+/* Call after changing slice_new/period_new or the split of a VCPU */
+static inline void sc_update_shares(struct sc_vcpu_info *inf)
+{
+    inf->share_new = sc_share(inf->slice_new, inf->period_new);
+    inf->share_a = sc_share(inf->slice_a, inf->period_a);
+    inf->share_b = sc_share(inf->slice_b, inf->period_b);
+}
+
+/*
+ * What switching costs is measured, see sc_context_saved(), and taken off
+ * the local slices so the next VCPU starts on time; sc_overhead() makes
+ * admission leave room for it and sc_plan_bw() hands it back to the VCPUs.
+ */
+static inline void sc_cost_sample(s_time_t *cost, s_time_t sample)
+{
+    if(sample < 0 || sample > SC_COST_MAX)
+	return;
+
+    *cost += (sample - *cost) / (1 << SC_COST_SHIFT);
+}
+
+/* Worst switch, or handoff, cost measured on any CPU of this instance */
+static s_time_t sc_switch_cost(struct sc_priv_info *prv, int handoff)
+{
+    struct sc_cpu_info *spc;
+    s_time_t cost = 0;
+
+    list_for_each_entry ( spc, &prv->cpus, cpu_elem )
+	cost = max(cost, handoff ? spc->handoff_cost : spc->switch_cost);
+
+    return cost;
+}
+
+/* Shortest slice worth switching to on cpu */
+static inline s_time_t sc_min_slice(int cpu)
+{
+    return max((s_time_t)SLICE_MIN, 2 * CPU_INFO(cpu)->switch_cost);
+}
+
+/* Have the next SC_CALIBRATE_BOUNDARIES boundaries sampled for sc_calibrate() */
+static void sc_calibrate_start(struct sc_priv_info *prv)
+{
+    struct sc_cpu_info *spc;
+
+    list_for_each_entry ( spc, &prv->cpus, cpu_elem )
+	spc->sched_cost = 0;
+    prv->barrier_cost = 0;
+    prv->calibrating = SC_CALIBRATE_BOUNDARIES;
+
+    printk("--- %s -- calibrating over %d boundaries ---\n", __func__, SC_CALIBRATE_BOUNDARIES);
+}
+
+/*
+ * End of a calibration run: derive the timing constants from what getting
+ * through a boundary, sc_do_schedule() and a switch were measured to cost.
+ * Each is made long enough that what it stands for costs no more than
+ * 1/SC_OVERHEAD_RATIO of it, and a CPU is full once what is left of the
+ * shortest global slice would not pay for getting a VCPU running. The
+ * defaults are what hosts where all of this stays under SLICE_MIN need,
+ * so a run only ever lengthens them. Called with prv->lock held.
+ */
+static void sc_calibrate(struct sc_priv_info *prv)
+{
+    struct sc_cpu_info *spc;
+    s_time_t sched_cost = 0, cost;
+
+    list_for_each_entry ( spc, &prv->cpus, cpu_elem )
+	sched_cost = max(sched_cost, spc->sched_cost);
+    cost = sched_cost + sc_switch_cost(prv, 0);
+
+    prv->min_global_slice = max(SC_OVERHEAD_RATIO * (prv->barrier_cost + cost), SC_MIN_GLOBAL_SLICE);
+    prv->shift_delay = max(3 * (prv->barrier_cost + cost), SC_SHIFT_DELAY);
+    prv->extra_quantum = max(SC_OVERHEAD_RATIO * cost, EXTRA_QUANTUM);
+    prv->full_slack = max(DIV_UP(100000 * cost, prv->min_global_slice), (s_time_t)SC_FULL_SLACK);
+
+    printk("--- %s -- barrier: %ld - schedule: %ld - switch: %ld ns => min global slice: %ld - shift delay: %ld - extra quantum: %ld ns - full slack: %ld ---\n",
+	    __func__, prv->barrier_cost, sched_cost, sc_switch_cost(prv, 0),
+	    prv->min_global_slice, prv->shift_delay, prv->extra_quantum,
+	    prv->full_slack);
+}
+
 #define sc_runnable(edom)  (!(EDOM_INFO(edom)->status & SC_ASLEEP))
 //#define sc_active(edom)  (!(EDOM_INFO(edom)->status & SC_INACTIVE))
 
@@ -369,10 +789,87 @@ static void init_sc_barrier(struct sc_barrier_t* b)
 {
     atomic_set(&b->cpu_count, 0);
     atomic_set(&b->updating_global_deadline, -1);
+    b->epoch = 0;
+}
+
+/*
+ * CPU the instance's tasklets run on: the first of its own, which is one of
+ * dom0's where it has any, so neither the guest CPUs nor other pools pay
+ * for them.
+ */
+static inline unsigned int sc_tasklet_cpu(struct sc_priv_info *prv)
+{
+    unsigned int cpu = cpumask_first(&prv->cpumask);
+
+    return (cpu < nr_cpu_ids ? cpu : smp_processor_id());
+}
+
+/* Set while some CPU is computing the next global boundary */
+static inline int sc_boundary_busy(struct sc_priv_info *prv)
+{
+    return read_atomic(&prv->cpu_barrier.epoch) & 1;
+}
+
+/*
+ * Send the IPIs gathered in prv->kick, one multicast for all of them. A
+ * CPU that sets its bit while this runs either makes it in or finds the
+ * boundary published already.
+ */
+static void sc_kick(struct sc_priv_info *prv)
+{
+    cpumask_t mask;
+    int cpu;
+
+    cpumask_copy(&mask, &prv->kick);
+    for_each_cpu ( cpu, &mask )
+	cpumask_clear_cpu(cpu, &prv->kick);
+    cpumask_clear_cpu(smp_processor_id(), &mask);
+
+    cpumask_raise_softirq(&mask, SCHEDULE_SOFTIRQ);
+}
+
+/*
+ * The RT channel v shares with its guest's RT scheduler, in the domain's
+ * shared_info, or NULL until the guest set it up with our version.
+ */
+static inline struct xen_rtvirt_channel *sc_channel(struct vcpu *v)
+{
+    struct shared_info *si = (struct shared_info *) v->domain->shared_info;
+    struct xen_rtvirt_channel *ch = &si->rtvirt[v->vcpu_id];
+
+    if(read_atomic(&ch->version) != XEN_RTVIRT_CHANNEL_VERSION)
+	return NULL;
+
+    return ch;
 }
 
-static int last_assigned_pcpu = 0;
-static int dom0_cpu_count = 0;
+/*
+ * Consume the deadline hints the guest sent since the last call and return
+ * the first one after now, or 0 if there is none. Hints that are already
+ * past are dropped; each one is looked at exactly once.
+ */
+static s_time_t sc_channel_hint(struct xen_rtvirt_channel *ch, s_time_t now)
+{
+    uint32_t cons = ch->cons;
+    uint32_t prod = read_atomic(&ch->prod);
+    s_time_t hint = 0;
+
+    // A guest that got more than a ring ahead overwrote its oldest hints
+    if(prod - cons > XEN_RTVIRT_RING_SIZE)
+	cons = prod - XEN_RTVIRT_RING_SIZE;
+
+    // Read the hints only after prod
+    smp_rmb();
+
+    while(cons != prod && hint <= now)
+	hint = ch->hint[cons++ % XEN_RTVIRT_RING_SIZE];
+
+    // ... and give their slots back only once they are read
+    smp_mb();
+    write_atomic(&ch->cons, cons);
+
+    return (hint > now ? hint : 0);
+}
 
 /* return the greatest common divisor of a and b using Euclid's algorithm,
    modified to be fast when one argument much greater than the other, and
@@ -420,11 +917,6 @@ static inline int __task_on_queue(struct vcpu *d)
     return (((LIST(d))->next != NULL) && (LIST(d)->next != LIST(d)));
 }
 
-static inline int task_on_deadline_queue(struct vcpu *d)
-{
-    return (((D_LIST(d))->next != NULL) && (D_LIST(d)->next != D_LIST(d)));
-}
-
 static inline void __del_from_queue(struct vcpu *d)
 {
     struct list_head *list = LIST(d);
@@ -434,51 +926,14 @@ static inline void __del_from_queue(struct vcpu *d)
     ASSERT(!__task_on_queue(d));
 }
 
-typedef int(*list_comparer)(struct list_head* el1, struct list_head* el2);
-
-static inline void list_insert_sort(
-    struct list_head *list, struct list_head *element, list_comparer comp)
-{
-    struct list_head     *cur;
-
-    /* Iterate through all elements to find our "hole" */
-    list_for_each( cur, list )
-        if ( comp(element, cur) < 0 )
-            break;
-
-    /* cur now contains the element, before which we'll enqueue */
-    list_add(element, cur->prev);
-}
-
-#define DOMAIN_COMPARER(name, field, comp1, comp2)                      \
-static int name##_comp(struct list_head* el1, struct list_head* el2)    \
-{                                                                       \
-    struct sc_vcpu_info *d1, *d2;                                     \
-    d1 = list_entry(el1,struct sc_vcpu_info, field);                  \
-    d2 = list_entry(el2,struct sc_vcpu_info, field);                  \
-    if ( (comp1) == (comp2) )                                           \
-        return 0;                                                       \
-    if ( (comp1) < (comp2) )                                            \
-        return -1;                                                      \
-    else                                                                \
-        return 1;                                                       \
-}
-
-DOMAIN_COMPARER(runq, d_list, d1->deadl_abs, d2->deadl_abs);
-
-static struct list_head sc_list_head;
-
-static int reverse_order_next = 1; // This variable should only be accessed by CPU 0
-static s_time_t global_deadline = 0;
-
 // A periodic VCPU always has its BW reservation activated.
 // A sporadic VCPU activates it only when it arrives.
-static void activate_cpu_bw_reservation(struct vcpu *d)
+static void activate_cpu_bw_reservation(struct sc_priv_info *prv, struct vcpu *d)
 {
     int first_cpu, second_cpu;
 
     first_cpu = EDOM_INFO(d)->processor_a;
-    second_cpu = first_cpu + 1;
+    second_cpu = CPU_INFO(first_cpu)->fill_next;
 /*
     DPRINTK4("------ CPU: %d - FIRST: %d - ID: %6d.%d - %s ------\n",
 	    smp_processor_id(),
@@ -496,7 +951,7 @@ static void activate_cpu_bw_reservation(struct vcpu *d)
 
     EDOM_INFO(d)->status |= SC_WOKEN;
 
-    if((CPU_INFO(first_cpu)->used_slice + 1000)
+    if((CPU_INFO(first_cpu)->used_slice + prv->full_slack)
 	    > CPU_INFO(first_cpu)->used_period)
     {
 	CPU_INFO(first_cpu)->used_slice =
@@ -576,6 +1031,8 @@ static void activate_cpu_bw_reservation(struct vcpu *d)
 	EDOM_INFO(d)->period_a =
 	    EDOM_INFO(d)->period_b = 100000;
 
+	sc_update_shares(EDOM_INFO(d));
+
 	CPU_INFO(first_cpu)->used_slice =
 	    CPU_INFO(first_cpu)->used_period;
 
@@ -598,7 +1055,7 @@ static void activate_cpu_bw_reservation(struct vcpu *d)
     }
 }
 
-static void set_cpu_bw_reservation(struct vcpu *d)
+static void set_cpu_bw_reservation(struct sc_priv_info *prv, struct vcpu *d)
 {
     int first_cpu, second_cpu;
 
@@ -611,14 +1068,14 @@ static void set_cpu_bw_reservation(struct vcpu *d)
 */
 
     first_cpu = EDOM_INFO(d)->processor_a;
-    second_cpu = EDOM_INFO(d)->processor_a + 1;
+    second_cpu = EDOM_INFO(d)->processor_b;
 
     if(EDOM_INFO(d)->status & SC_SPORADIC || EDOM_INFO(d)->status & SC_ARRIVED)
     {
 	EDOM_INFO(d)->status &= ~SC_SPLIT;
 	EDOM_INFO(d)->status &=	~SC_MIGRATING;
 
-	activate_cpu_bw_reservation(d);
+	activate_cpu_bw_reservation(prv, d);
     }
     else
     {
@@ -653,7 +1110,7 @@ static void set_cpu_bw_reservation(struct vcpu *d)
 
 // A periodic VCPU always has its BW reservation activated.
 // A sporadic VCPU activates it only when it arrives.
-static void dynamic_activate(struct vcpu *d)
+static void dynamic_activate(struct sc_priv_info *prv, struct vcpu *d)
 {
     int first_cpu, second_cpu;
     DPRINTK3("------ CPU: %d - ID: %6d.%d - %s ------\n",
@@ -669,9 +1126,9 @@ static void dynamic_activate(struct vcpu *d)
     EDOM_INFO(d)->status |= SC_WOKEN;
 
     first_cpu = EDOM_INFO(d)->processor_a;
-    second_cpu = first_cpu + 1;
+    second_cpu = CPU_INFO(first_cpu)->fill_next;
 
-    if((CPU_INFO(first_cpu)->used_slice + 1000)
+    if((CPU_INFO(first_cpu)->used_slice + prv->full_slack)
 	    > CPU_INFO(first_cpu)->used_period)
     {
 	CPU_INFO(first_cpu)->used_slice =
@@ -727,6 +1184,8 @@ static void dynamic_activate(struct vcpu *d)
 	EDOM_INFO(d)->period_a =
 	    EDOM_INFO(d)->period_b = 100000;
 
+	sc_update_shares(EDOM_INFO(d));
+
 	CPU_INFO(first_cpu)->used_slice =
 	    CPU_INFO(first_cpu)->used_period;
 
@@ -749,7 +1208,7 @@ static void dynamic_activate(struct vcpu *d)
     }
 }
 
-static void dynamic_reservation(struct vcpu *d)
+static void dynamic_reservation(struct sc_priv_info *prv, struct vcpu *d)
 {
     int first_cpu, second_cpu;
 
@@ -760,247 +1219,1077 @@ static void dynamic_reservation(struct vcpu *d)
 	    __func__);
 
     first_cpu = EDOM_INFO(d)->processor_a;
-    second_cpu = EDOM_INFO(d)->processor_a + 1;
+    second_cpu = EDOM_INFO(d)->processor_b;
 
     if(EDOM_INFO(d)->status & SC_SPORADIC || EDOM_INFO(d)->status & SC_ARRIVED)
     {
 	EDOM_INFO(d)->status &= ~SC_SPLIT;
 	EDOM_INFO(d)->status &=	~SC_MIGRATING;
 
-	dynamic_activate(d);
+	dynamic_activate(prv, d);
     }
 }
 
-static int dp_wrap_assign_pcpu(struct vcpu *v, const struct scheduler *ops)
+/*
+ * Place a VCPU with bandwidth slice_new/period_new on the first CPU of plan
+ * with room left, splitting it across that CPU and the next one in the fill
+ * order if it does not fit. Only plan and *a are written, so this can run
+ * on a plan that no CPU is using yet. Returns 1 if the VCPU was placed.
+ */
+static int dp_wrap_place(struct sc_plan *plan, s_time_t slice_new, s_time_t period_new, struct sc_assignment *a)
 {
-    // -> struct sc_priv_info *prv = SC_PRIV(ops);
-    // -> unsigned long flags;
-
-    int cpu_i;
-    spinlock_t *lock;
+    int r, cpu_i;
     s_time_t hslice_total, hperiod_total;
     s_time_t hslice, hremainder, vslice;
-    unsigned int nr_cpus = cpumask_last(&cpu_online_map) + 1;
-
-    // -> spin_lock_irqsave(&prv->lock, flags);
-
-    EDOM_INFO(v)->status &= ~SC_SHIFT;
-    EDOM_INFO(v)->status &= ~SC_SPLIT;
-    EDOM_INFO(v)->status &= ~SC_MIGRATED;
-
-    DPRINTK("------ CPU: %d - %s - %d ------\n",
-	    smp_processor_id(),
-	    __func__,
-	    __LINE__);
+    unsigned int nr_cpus = plan->nr_cpus;
 
+    a->placed = 0;
+    a->split = 0;
 
     //printk("--- period new: %llu - slice new: %llu ---\n",
-//	    (unsigned long long) EDOM_INFO(v)->period_new,
-//	    (unsigned long long) EDOM_INFO(v)->slice_new);
-
+//	    (unsigned long long) period_new,
+//	    (unsigned long long) slice_new);
 
-//    this_cpu = smp_processor_id();
-    for(cpu_i = 0; cpu_i < nr_cpus; cpu_i++)
+    // Full CPUs are not in room, so this skips straight to the first one
+    // that can take anything
+    for(r = cpumask_first(&plan->room); r < nr_cpus;
+	    r = cpumask_next(r, &plan->room))
     {
-	lock = NULL;
+	cpu_i = plan->fill[r];
 
-//	if(this_cpu != cpu_i)
-//	    while(!lock)
-//		lock = pcpu_schedule_trylock(cpu_i);
-
-	if( HSLICE(cpu_i) == HPERIOD(cpu_i) )
-	{
-//	    if(this_cpu != cpu_i)
-//		pcpu_schedule_unlock(lock, cpu_i);
-	    continue;
-	}
-	else if( HSLICE(cpu_i) != 0 && HSLICE(cpu_i) + 1000 >= HPERIOD(cpu_i) )
+	if(sc_plan_full(plan, cpu_i))
 	{
-	    HSLICE(cpu_i) = HPERIOD(cpu_i) = 100000;
+	    sc_plan_set(plan, cpu_i, 100000, 100000);
 	    continue;
 	}
 
-	DPRINTK("-- Check1 - cpu: %d - s: %llu p: %llu --\n",
-		cpu_i, HSLICE(cpu_i), HPERIOD(cpu_i));
+	hperiod_total = lcm( HPERIOD(plan, cpu_i), period_new);
 
-	hperiod_total = lcm( HPERIOD(cpu_i), EDOM_INFO(v)->period_new);
-
-	hslice = ((HSLICE(cpu_i) * (hperiod_total/HPERIOD(cpu_i))));
-	vslice =  (EDOM_INFO(v)->slice_new * (hperiod_total/EDOM_INFO(v)->period_new));
+	hslice = ((HSLICE(plan, cpu_i) * (hperiod_total/HPERIOD(plan, cpu_i))));
+	vslice =  (slice_new * (hperiod_total/period_new));
 	hremainder = hperiod_total - hslice;
 
-	hslice_total = ((HSLICE(cpu_i) * (hperiod_total/HPERIOD(cpu_i)))) +
-	    (EDOM_INFO(v)->slice_new * (hperiod_total/EDOM_INFO(v)->period_new));
+	hslice_total = ((HSLICE(plan, cpu_i) * (hperiod_total/HPERIOD(plan, cpu_i)))) +
+	    (slice_new * (hperiod_total/period_new));
 
 	if(hslice_total < hperiod_total)
 	{
-	    HSLICE(cpu_i) = hslice_total;
-	    HPERIOD(cpu_i) = hperiod_total;
+	    sc_plan_set(plan, cpu_i, hslice_total, hperiod_total);
 
-	    if(v->processor != cpu_i)
-	    {
-		v->processor = cpu_i;
-		EDOM_INFO(v)->processor_a = cpu_i;
-//		EDOM_INFO(v)->status |= SC_MIGRATED;
-		last_assigned_pcpu = (cpu_i > last_assigned_pcpu ? cpu_i : last_assigned_pcpu);
-		//set_bit(_VPF_migrating, &v->pause_flags);
-		list_move_tail(LIST(v), INACTIVEQ(cpu_i));
-		cpu_raise_softirq(v->processor, SCHEDULE_SOFTIRQ);
-	    }
-	    else
-	    {
-		v->processor = cpu_i;
-		EDOM_INFO(v)->processor_a = cpu_i;
-		list_move_tail(LIST(v), INACTIVEQ(cpu_i));
-	    }
+	    a->processor_a = cpu_i;
+	}
+	else if(hslice_total > hperiod_total)
+	{
+	    if(r + 1 == nr_cpus)
+		return 0;
+
+	    // ->processor point to the host processor, ->processor_a is the processor which schedules
+	    sc_plan_set(plan, cpu_i, 100000, 100000);
+
+	    a->processor_a = cpu_i;
 
+	    a->period_a = hperiod_total;
+	    a->slice_a = hremainder; //FIXME: Hack to avoid overflows
+
+	    cpu_i = plan->fill[r + 1];
+
+	    if(HSLICE(plan, cpu_i) > HPERIOD(plan, cpu_i))
+		printk("-- NOOP - Something bad happened: cpu: %d - s: %llu p: %llu --\n", cpu_i, HSLICE(plan, cpu_i), HPERIOD(plan, cpu_i));
+
+	    a->slice_b = vslice - hremainder;
+	    a->period_b = hperiod_total;
+	    sc_plan_set(plan, cpu_i, a->slice_b, a->period_b);
+	    a->processor_b = cpu_i;
+	    a->split = 1;
 	}
 	else
 	{
-	    if(hslice_total > hperiod_total)
-	    {
-		if(cpu_i + 1 == nr_cpus)
-		{
-//		    if(this_cpu != cpu_i)
-//			pcpu_schedule_unlock(lock, cpu_i);
-		    // -> spin_unlock_irqrestore(&prv->lock, flags);
-		    return 0;
-		}
+	    sc_plan_set(plan, cpu_i, 100000, 100000);
 
-		// ->processor point to the host processor, ->processor_a is the processor which schedules
-		HSLICE(cpu_i) = 100000;
-		HPERIOD(cpu_i) = 100000;
+	    a->processor_a = cpu_i;
+	}
 
-/*		if(v->processor != cpu_i)
-		{
-		    v->processor = cpu_i;
-		    list_move_tail(LIST(v), INACTIVEQ(cpu_i));
-		    cpu_raise_softirq(v->processor, SCHEDULE_SOFTIRQ);
-		}
-*/
-		EDOM_INFO(v)->processor_a = cpu_i;
+	a->placed = 1;
+	return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * The helpers below work on plans where every CPU has a hyper-period of
+ * 100000, which is what every guest's period_new is. Unlike dp_wrap_place()
+ * they add to a CPU instead of assuming the one after the last full CPU is
+ * empty, so they can fill the holes a plan built from an older one has.
+ */
+static inline s_time_t sc_plan_room(struct sc_plan *plan, int cpu)
+{
+    return HPERIOD(plan, cpu) - HSLICE(plan, cpu);
+}
+
+/* CPU after cpu in plan's fill order, or -1 if cpu is the last one */
+static inline int sc_plan_next(struct sc_plan *plan, int cpu)
+{
+    int r = plan->rank[cpu] + 1;
+
+    return (r < plan->nr_cpus ? plan->fill[r] : -1);
+}
+
+/*
+ * Put a VCPU of bandwidth bw back on the CPUs a had it on, if it still fits
+ * there. A split VCPU fills up processor_a first and only keeps what is
+ * left on processor_b, as dp_wrap_place() would have split it, and only if
+ * processor_b still comes right after processor_a in the fill order.
+ * Returns 1 if it stayed.
+ */
+static int dp_wrap_stay(struct sc_plan *plan, s_time_t bw, struct sc_assignment *a)
+{
+    int cpu = a->processor_a;
+    s_time_t room;
+
+    if(!a->placed || !cpumask_test_cpu(plan->rank[cpu], &plan->room))
+	return 0;
+
+    if(sc_plan_full(plan, cpu))
+	return 0;
+
+    room = sc_plan_room(plan, cpu);
+
+    if(bw <= room)
+    {
+	sc_plan_set(plan, cpu, HSLICE(plan, cpu) + bw, HPERIOD(plan, cpu));
+	a->split = 0;
+	return 1;
+    }
+
+    if(!a->split || a->processor_b != sc_plan_next(plan, cpu) ||
+	    bw - room > sc_plan_room(plan, a->processor_b))
+	return 0;
+
+    a->slice_a = room;
+    a->slice_b = bw - room;
+    a->period_a = a->period_b = HPERIOD(plan, cpu);
+    sc_plan_set(plan, cpu, HPERIOD(plan, cpu), HPERIOD(plan, cpu));
+    sc_plan_set(plan, a->processor_b, HSLICE(plan, a->processor_b) + a->slice_b,
+	    HPERIOD(plan, a->processor_b));
+
+    return 1;
+}
+
+/*
+ * Place a VCPU of bandwidth bw on the first CPU with room for it, splitting
+ * it across that CPU and the next one in the fill order if those have room
+ * enough between them and are in the same package (cpu_core_mask). On empty
+ * CPUs of a single package this places exactly like dp_wrap_place() does.
+ * Returns 1 if the VCPU was placed.
+ */
+static int dp_wrap_fill(struct sc_plan *plan, s_time_t bw, struct sc_assignment *a)
+{
+    int r, cpu, next;
+    s_time_t room;
+    unsigned int nr_cpus = plan->nr_cpus;
+
+    a->placed = 0;
+    a->split = 0;
+
+    for(r = cpumask_first(&plan->room); r < nr_cpus;
+	    r = cpumask_next(r, &plan->room))
+    {
+	cpu = plan->fill[r];
+	if(sc_plan_full(plan, cpu))
+	{
+	    sc_plan_set(plan, cpu, 100000, 100000);
+	    continue;
+	}
+
+	room = sc_plan_room(plan, cpu);
+
+	if(bw <= room)
+	{
+	    sc_plan_set(plan, cpu, HSLICE(plan, cpu) + bw, HPERIOD(plan, cpu));
+	    a->processor_a = cpu;
+	    a->placed = 1;
+	    return 1;
+	}
+
+	// A split VCPU migrates twice a slice, so it does not leave its package
+	if(r + 1 == nr_cpus)
+	    continue;
+	next = plan->fill[r + 1];
+	if(!cpumask_test_cpu(next, per_cpu(cpu_core_mask, cpu)) ||
+		bw - room > sc_plan_room(plan, next))
+	    continue;
+
+	a->processor_a = cpu;
+	a->processor_b = next;
+	a->slice_a = room;
+	a->slice_b = bw - room;
+	a->period_a = a->period_b = HPERIOD(plan, cpu);
+	sc_plan_set(plan, cpu, HPERIOD(plan, cpu), HPERIOD(plan, cpu));
+	sc_plan_set(plan, next, HSLICE(plan, next) + a->slice_b,
+		HPERIOD(plan, next));
+	a->split = 1;
+	a->placed = 1;
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Whether a VCPU placed as old ends up on other CPUs once new is applied */
+static inline int sc_assign_moved(const struct sc_assignment *old, const struct sc_assignment *new)
+{
+    if(!old->placed)
+	return 0;
+
+    return (!new->placed ||
+	    old->split != new->split ||
+	    old->processor_a != new->processor_a ||
+	    (new->split && old->processor_b != new->processor_b));
+}
+
+/*
+ * Move a VCPU to where dp_wrap_place() put it: copy the split parameters
+ * and requeue it on its new host CPU. The CPUs that need to look again are
+ * left in prv->kick for the caller to sc_kick().
+ */
+static void dp_wrap_apply(struct sc_priv_info *prv, struct vcpu *v, struct sc_assignment *a)
+{
+    int cpu;
+
+    EDOM_INFO(v)->assign = *a;
+    EDOM_INFO(v)->status &= ~SC_SHIFT;
+    EDOM_INFO(v)->status &= ~SC_SPLIT;
+    EDOM_INFO(v)->status &= ~SC_MIGRATED;
+
+    if(!a->placed)
+	return;
+
+    cpu = EDOM_INFO(v)->processor_a = a->processor_a;
+
+    if(a->split)
+    {
+	EDOM_INFO(v)->period_a = a->period_a;
+	EDOM_INFO(v)->slice_a = a->slice_a;
+	EDOM_INFO(v)->period_b = a->period_b;
+	EDOM_INFO(v)->slice_b = a->slice_b;
+	EDOM_INFO(v)->processor_b = a->processor_b;
+	EDOM_INFO(v)->status |= SC_SPLIT;
+	sc_update_shares(EDOM_INFO(v));
+
+	// A split VCPU is hosted by its second CPU
+	cpu = a->processor_b;
+	prv->last_assigned_pcpu = (cpu > prv->last_assigned_pcpu ? cpu : prv->last_assigned_pcpu);
+    }
+
+    if(v->processor != cpu)
+    {
+	v->processor = cpu;
+	//set_bit(_VPF_migrating, &v->pause_flags);
+	list_move_tail(LIST(v), INACTIVEQ(cpu));
+
+	if(a->split)
+	{
+	    if(CPU_INFO(cpu)->new_gl_d == 0)
+		CPU_INFO(cpu)->new_gl_d = prv->global_deadline;
+	}
+	else
+	    prv->last_assigned_pcpu = (cpu > prv->last_assigned_pcpu ? cpu : prv->last_assigned_pcpu);
+
+	cpumask_set_cpu(cpu, &prv->kick);
+    }
+    else
+    {
+	list_move_tail(LIST(v), INACTIVEQ(cpu));
+
+	// An idle CPU without a boundary yet arms no timer, see sc_idle_time()
+	if(CPU_INFO(cpu)->new_gl_d == 0)
+	    cpumask_set_cpu(cpu, &prv->kick);
+    }
+}
+
+static inline uint32_t sc_trace_ns(s_time_t t)
+{
+    if(t < 0)
+	return 0;
+
+    return (t > 0xffffffffLL ? 0xffffffffU : (uint32_t)t);
+}
+
+/*
+ * Next free record in cpu's trace ring, or NULL if tracing has no ring for
+ * it or the ring is full. Only ever called on cpu itself.
+ */
+static inline struct sc_trace_rec *sc_trace_get(struct sc_priv_info *prv, int cpu)
+{
+    struct sc_trace_ring *ring = prv->trace[cpu];
+
+    if(ring == NULL)
+	return NULL;
+
+    if(ring->head - read_atomic(&ring->tail) >= SC_TRACE_RECS)
+    {
+	ring->dropped++;
+	return NULL;
+    }
+
+    return &ring->recs[ring->head & (SC_TRACE_RECS - 1)];
+}
+
+/* Publish the record sc_trace_get() returned, kicking the drain at half full */
+static inline void sc_trace_put(struct sc_priv_info *prv, int cpu)
+{
+    struct sc_trace_ring *ring = prv->trace[cpu];
+    unsigned int head = ring->head + 1;
+
+    smp_wmb();
+    write_atomic(&ring->head, head);
+
+    if(head - read_atomic(&ring->tail) == SC_TRACE_RECS / 2)
+	tasklet_schedule_on_cpu(&prv->trace_tasklet, sc_tasklet_cpu(prv));
+}
+
+/*
+ * Print what the CPUs have traced so far, off the scheduling path. Runs
+ * again if any ring had more than a batch waiting.
+ */
+static void sc_trace_tasklet(unsigned long data)
+{
+    const struct scheduler *ops = (const struct scheduler *)data;
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    struct sc_trace_ring *ring;
+    struct sc_trace_rec *trc;
+    unsigned int head, tail, dropped;
+    int cpu, n, more = 0;
+
+    for(cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+	ring = read_atomic(&prv->trace[cpu]);
+	if(ring == NULL)
+	    continue;
+
+	tail = ring->tail;
+	head = read_atomic(&ring->head);
+	smp_rmb();
+
+	for(n = 0; tail != head && n < SC_TRACE_BATCH; n++, tail++)
+	{
+	    trc = &ring->recs[tail & (SC_TRACE_RECS - 1)];
+
+	    // Same columns as the old d_array dump
+	    printk("- %d %ld %7d.%u %u %u %u -\n",
+		    cpu,
+		    (trc->event == SC_TRC_BOUNDARY ? trc->stamp : (s_time_t)trc->cost),
+		    trc->domid,
+		    trc->vcpuid,
+		    trc->ret_time,
+		    trc->cputime,
+		    trc->alloc);
+	}
+
+	smp_mb();
+	write_atomic(&ring->tail, tail);
+
+	if(tail != head)
+	    more = 1;
+
+	dropped = read_atomic(&ring->dropped);
+	if(dropped != ring->dropped_seen)
+	{
+	    printk("- %d dropped %u -\n", cpu, dropped - ring->dropped_seen);
+	    ring->dropped_seen = dropped;
+	}
+    }
+
+    if(more)
+	tasklet_schedule_on_cpu(&prv->trace_tasklet, sc_tasklet_cpu(prv));
+}
+
+/*
+ * Give every CPU in the pool a trace ring. Rings are kept once allocated, so
+ * this only allocates on the first start and for CPUs added since.
+ */
+static int sc_trace_start(const struct scheduler *ops, struct domain *d)
+{
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    struct sc_trace_ring *ring;
+    int cpu;
+
+    for_each_cpu ( cpu, cpupool_scheduler_cpumask(d->cpupool) )
+    {
+	if(prv->trace[cpu] != NULL)
+	    continue;
+
+	ring = xzalloc(struct sc_trace_ring);
+	if(ring == NULL)
+	    return -ENOMEM;
+	ring->last_domid = DOMID_INVALID;
+
+	if(cmpxchg(&prv->trace[cpu], NULL, ring) != NULL)
+	    xfree(ring);
+    }
+
+    return 0;
+}
+
+/* The plan neither in use nor the shadow, which only sc_plan_build() writes */
+static inline struct sc_plan *sc_plan_scratch(struct sc_priv_info *prv)
+{
+    int i;
+
+    for(i = 0; i < 2; i++)
+	if(&prv->plans[i] != prv->plan && &prv->plans[i] != prv->shadow)
+	    return &prv->plans[i];
+
+    return &prv->plans[2];
+}
+
+/* CPUs of this instance dom0 leaves to the guests. Called with prv->lock held. */
+static inline unsigned int sc_guest_cpus(struct sc_priv_info *prv)
+{
+    return cpumask_weight(&prv->cpumask) - prv->dom0_cpu_count;
+}
+
+/*
+ * Bandwidth (1/100000 CPU) a plan can hand out on the guest CPUs. Placing
+ * moves on from a CPU once it is full, see sc_plan_full(), which can leave
+ * up to full_slack unused on every CPU but the last.
+ */
+static inline s_time_t sc_capacity(struct sc_priv_info *prv)
+{
+    s_time_t nr = sc_guest_cpus(prv);
+
+    return nr * 100000 - max(nr - 1, (s_time_t)0) * prv->full_slack;
+}
+
+/*
+ * Set the order plan fills the CPUs in: dom0's CPUs first, then the
+ * instance's CPUs one package (cpu_core_mask) at a time with the SMT
+ * siblings of each core next to each other, then whatever CPUs are left.
+ * Neighbours in this order, which is where splits land, then share a
+ * package and, for siblings, a core; only the last CPU of one package and
+ * the first of the next do not, and no split goes across those unless the
+ * VCPUs do not fit otherwise, see sc_plan_build(). Xen has no mask for the
+ * CPUs behind one last-level cache, so the package is as close as this
+ * gets: where a package has more than one LLC, neighbours may not share it.
+ */
+static void sc_plan_order(struct sc_priv_info *prv, struct sc_plan *plan)
+{
+    cpumask_t done;
+    int r = 0, cpu, core, smt;
+
+    cpumask_clear(&done);
+
+    for(cpu = 0; cpu < prv->dom0_cpu_count; cpu++)
+    {
+	if(!cpumask_test_cpu(cpu, &prv->cpumask))
+	    continue;
+
+	plan->fill[r++] = cpu;
+	cpumask_set_cpu(cpu, &done);
+    }
+
+    for_each_cpu ( cpu, &prv->cpumask )
+    {
+	if(cpumask_test_cpu(cpu, &done))
+	    continue;
+
+	for_each_cpu ( core, per_cpu(cpu_core_mask, cpu) )
+	{
+	    if(!cpumask_test_cpu(core, &prv->cpumask) || cpumask_test_cpu(core, &done))
+		continue;
+
+	    for_each_cpu ( smt, per_cpu(cpu_sibling_mask, core) )
+	    {
+		if(!cpumask_test_cpu(smt, &prv->cpumask) || cpumask_test_cpu(smt, &done) ||
+			!cpumask_test_cpu(smt, per_cpu(cpu_core_mask, cpu)))
+		    continue;
+
+		plan->fill[r++] = smt;
+		cpumask_set_cpu(smt, &done);
+	    }
+	}
+    }
+
+    for_each_cpu ( cpu, &prv->cpumask )
+	if(!cpumask_test_cpu(cpu, &done))
+	{
+	    plan->fill[r++] = cpu;
+	    cpumask_set_cpu(cpu, &done);
+	}
+    plan->nr_cpus = r;
+
+    // Other pools' CPUs only keep rank and fill a permutation
+    for(cpu = 0; cpu < NR_CPUS; cpu++)
+	if(!cpumask_test_cpu(cpu, &done))
+	    plan->fill[r++] = cpu;
+
+    for(r = 0; r < NR_CPUS; r++)
+	plan->rank[plan->fill[r]] = r;
+
+    // The ranks moved under room
+    for(cpu = 0; cpu < NR_CPUS; cpu++)
+	sc_plan_set(plan, cpu, HSLICE(plan, cpu), HPERIOD(plan, cpu));
+}
+
+/*
+ * Take a CPU or dom0 change into the fill order of the plan in use, which
+ * the shadow plan copies. Everything is placed again from the first guest
+ * CPU on, so no split is left on CPUs that are not neighbours any more.
+ * Called with prv->lock held.
+ */
+static void sc_plan_reorder(struct sc_priv_info *prv)
+{
+    unsigned int nr_cpus;
+    int r, next;
+
+    if(!prv->plan_reorder)
+	return;
+    prv->plan_reorder = 0;
+
+    sc_plan_order(prv, prv->plan);
+    nr_cpus = prv->plan->nr_cpus;
+
+    for(r = 0; r < nr_cpus; r++)
+    {
+	if(CPU_INFO(prv->plan->fill[r]) == NULL)
+	    continue;
+
+	// The last CPU has nothing after it to spill onto
+	next = (r + 1 < nr_cpus ? prv->plan->fill[r + 1] : prv->plan->fill[r]);
+	CPU_INFO(prv->plan->fill[r])->fill_next = next;
+    }
+
+    prv->plan_from = 0;
+}
+
+/*
+ * Put sc_list_head back in the order the CPUs are filled in: by the rank of
+ * next_assign.processor_a, with the VCPU split onto the next CPU last on
+ * its first one. set_cpu_bw_reservation() fits the sporadic VCPUs in this
+ * order at every boundary and only lands on the plan's splits if it is.
+ * Only the nr VCPUs sc_plan_build() placed again need it: they are the
+ * tail of the list, and none went to a CPU ranked before from.
+ */
+static void sc_plan_sort(struct sc_priv_info *prv, struct sc_plan *plan, int from,
+	struct sc_plan_vcpu *vcpus, int nr)
+{
+    struct sc_vcpu_info *curinf;
+    struct sc_plan_vcpu *pv;
+    struct list_head *cur, *tmp, *bucket;
+    struct list_head splits, unplaced;
+    int i;
+
+    INIT_LIST_HEAD(&splits);
+    INIT_LIST_HEAD(&unplaced);
+    for(i = from; i < plan->nr_cpus; i++)
+	INIT_LIST_HEAD(&prv->plan_order[i]);
+
+    for(pv = vcpus; pv < vcpus + nr; pv++)
+    {
+	cur = &pv->inf->sc_list;
+
+	if(!pv->next_assign.placed)
+	    list_move_tail(cur, &unplaced);
+	else if(pv->next_assign.split)
+	    list_move_tail(cur, &splits);
+	else
+	    list_move_tail(cur, &prv->plan_order[plan->rank[pv->next_assign.processor_a]]);
+    }
+
+    list_for_each_safe ( cur, tmp, &splits )
+    {
+	curinf = list_entry(cur, struct sc_vcpu_info, sc_list);
+	list_move_tail(cur, &prv->plan_order[plan->rank[curinf->next_assign.processor_a]]);
+    }
+
+    for(i = from; i < plan->nr_cpus; i++)
+    {
+	bucket = &prv->plan_order[i];
+	while(!list_empty(bucket))
+	    list_move_tail(bucket->next, &prv->sc_list_head);
+    }
+    while(!list_empty(&unplaced))
+	list_move_tail(unplaced.next, &prv->sc_list_head);
+}
+
+/*
+ * Bandwidth a VCPU asking for bw is placed with: that, plus the plan's
+ * share of the time it takes to be switched in. Never more than a whole CPU.
+ */
+static inline s_time_t sc_plan_bw(struct sc_plan *plan, s_time_t bw)
+{
+    return min(bw + plan->overhead, (s_time_t)100000);
+}
+
+/*
+ * Boundaries a second deadlines adding up to rate can bring. No global
+ * slice is shorter than min_global_slice, so there are never more than
+ * that allows.
+ */
+static inline s_time_t sc_boundary_rate(struct sc_priv_info *prv, s_time_t rate)
+{
+    return min(rate, SECONDS(1) / prv->min_global_slice);
+}
+
+/*
+ * The overhead the next plan gives every guest VCPU: it is switched in at
+ * every global boundary, and the guests' deadlines bring up to
+ * rate_admitted of those a second. At the measured cost, but never more than
+ * the slack admission left, so the plan always fits. It only follows the
+ * measurement when that moved by more than 1 / 2^SC_COST_SHIFT, as a new
+ * overhead has every guest CPU rebuilt.
+ */
+static s_time_t sc_plan_overhead(struct sc_priv_info *prv)
+{
+    s_time_t overhead, slack, live = prv->plan->overhead;
+
+    if(!prv->nr_admitted)
+	return 0;
+
+    overhead = DIV_UP(sc_switch_cost(prv, 0) * sc_boundary_rate(prv, prv->rate_admitted), 10000);
+    slack = sc_capacity(prv) - prv->bw_admitted;
+    overhead = max(min(overhead, slack / prv->nr_admitted), (s_time_t)0);
+
+    if(overhead - live <= (live >> SC_COST_SHIFT) && live - overhead <= (live >> SC_COST_SHIFT))
+	overhead = live;
+
+    return overhead;
+}
+
+/*
+ * Make room for count VCPUs in plan_vcpus. Only sc_plan_build() uses it,
+ * and never more than one at a time, so it needs no lock.
+ */
+static int sc_plan_reserve(struct sc_priv_info *prv, int count)
+{
+    struct sc_plan_vcpu *vcpus;
+    int capacity;
+
+    if(count <= prv->plan_capacity)
+	return 0;
+
+    capacity = (prv->plan_capacity ? prv->plan_capacity : SC_HEAP_MIN_CAPACITY);
+    while(capacity < count)
+	capacity *= 2;
+
+    vcpus = xzalloc_array(struct sc_plan_vcpu, capacity);
+    if(vcpus == NULL)
+	return -ENOMEM;
+
+    xfree(prv->plan_vcpus);
+    prv->plan_vcpus = vcpus;
+    prv->plan_capacity = capacity;
+    return 0;
+}
+
+/*
+ * Copy what the next plan is built from into next and plan_vcpus: the
+ * CPUs ranked before the first one that changed with what they hold in the
+ * plan in use, and the guest VCPUs that do not start on one of those, with
+ * the bandwidth they asked for. Those are the tail of sc_list_head (see
+ * sc_plan_commit()), so the list is only walked back as far as the first
+ * VCPU kept. With full set, everything is copied. Returns the rank the
+ * build starts from, and the VCPUs copied in *nr. Called with prv->lock
+ * held.
+ */
+static int sc_plan_snapshot(struct sc_priv_info *prv, struct sc_plan *next, int full, int *nr)
+{
+    struct sc_vcpu_info *curinf;
+    struct sc_plan_vcpu *pv, *lo, *hi, tmp;
+    struct list_head *cur;
+    unsigned int nr_cpus;
+    int r, i, from;
+
+    sc_plan_reorder(prv);
+    nr_cpus = prv->plan->nr_cpus;
+    from = max(prv->plan_from, prv->dom0_cpu_count);
+
+    // Kept CPUs carry the old overhead, so a new one rebuilds them all
+    next->full = prv->full_slack;
+    next->overhead = sc_plan_overhead(prv);
+    if(full || next->overhead != prv->plan->overhead)
+	from = prv->dom0_cpu_count;
+
+    // Ranks first, sc_plan_set() keeps room by them
+    memcpy(next->fill, prv->plan->fill, sizeof(next->fill));
+    memcpy(next->rank, prv->plan->rank, sizeof(next->rank));
+    next->nr_cpus = nr_cpus;
+    for(r = 0; r < nr_cpus; r++)
+    {
+	i = next->fill[r];
+	if(r < from)
+	    sc_plan_set(next, i, HSLICE(prv->plan, i), HPERIOD(prv->plan, i));
+	else
+	    sc_plan_set(next, i, 0, 100000);
+    }
+
+    // Nothing placed again goes before from, which keeps the kept VCPUs
+    // the head of the list
+    for(r = 0; r < from; r++)
+	cpumask_clear_cpu(r, &next->room);
+
+    pv = prv->plan_vcpus;
+    for(cur = prv->sc_list_head.prev; cur != &prv->sc_list_head; cur = cur->prev)
+    {
+	curinf = list_entry(cur, struct sc_vcpu_info, sc_list);
+
+	if(curinf->assign.placed && next->rank[curinf->assign.processor_a] < from)
+	{
+	    // Whatever wraps onto the first CPU rebuilt stays where it is.
+	    // Only the last VCPU kept can, being split last on its CPU.
+	    i = curinf->assign.processor_b;
+	    if(curinf->assign.split && next->rank[i] == from)
+		sc_plan_set(next, i, HSLICE(next, i) + curinf->assign.slice_b,
+			HPERIOD(next, i));
+	    break;
+	}
+
+	pv->inf = curinf;
+	pv->bw = (100000 * curinf->slice_temp) / curinf->period_temp;
+	pv->admitted = !!curinf->rate;
+	pv->assign = curinf->assign;
+	pv++;
+    }
+    *nr = pv - prv->plan_vcpus;
+
+    // Back into list order
+    for(lo = prv->plan_vcpus, hi = pv - 1; lo < hi; lo++, hi--)
+    {
+	tmp = *lo;
+	*lo = *hi;
+	*hi = tmp;
+    }
+
+    next->version = prv->plan_version;
+    return from;
+}
+
+/*
+ * Hand a plan sc_plan_build() finished over to the next boundary, unless
+ * something it was built from changed meanwhile. What the boundary applies
+ * to every VCPU is worked out here, so publishing it is no more than a
+ * copy. The VCPUs placed again go back to the tail of sc_list_head in fill
+ * order; the list is then in the order of the plan, and until it is
+ * published everything placed on a CPU ranked before plan_from still is
+ * the head of the list. Called with prv->lock held.
+ */
+static void sc_plan_commit(struct sc_priv_info *prv, struct sc_plan *next, int from, int nr)
+{
+    struct sc_plan_vcpu *pv;
+
+    if(next->version != prv->plan_version)
+	return;
+
+    for(pv = prv->plan_vcpus; pv < prv->plan_vcpus + nr; pv++)
+    {
+	pv->inf->next_assign = pv->next_assign;
+	pv->inf->next_bw = sc_plan_bw(next, pv->bw);
+    }
+
+    sc_plan_sort(prv, next, from, prv->plan_vcpus, nr);
+    if(from < prv->plan_from)
+	prv->plan_from = from;
+    prv->shadow = next;
+}
+
+/*
+ * Repartition the guest VCPUs into the shadow plan, using the parameters
+ * sc_adjust() left in period_temp/slice_temp. Nothing live is touched: the
+ * per-CPU half goes into the shadow plan and the per-VCPU half into
+ * next_assign, and both are only picked up when the next global boundary
+ * publishes the plan. prv->lock is only held to copy what the plan is built
+ * from and to hand it over, the partition itself is worked out on the copy.
+ *
+ * A VCPU that moves comes back to cold caches, so the plan in use is
+ * followed as far as it can be. Nothing changed before the CPU the first
+ * changed VCPU is on (plan_from): those CPUs are kept together with the
+ * VCPUs that start on them, which are neither copied nor looked at. From
+ * there on every VCPU first tries to stay on its CPUs, split VCPUs after
+ * the others so they get what is left of their pair, and only what no
+ * longer fits is placed in the room that remains. If that fails the plan is
+ * rebuilt from scratch, splitting within packages only. Only if that leaves
+ * a VCPU out is it rebuilt with dp_wrap_place(), which always fits what
+ * sc_admit() let in.
+ */
+static void sc_plan_build(struct sc_priv_info *prv)
+{
+    struct sc_plan *next;
+    struct sc_plan_vcpu *pv, *end;
+    unsigned long flags;
+    unsigned int nr_cpus;
+    int r, from, first, nr, full = 0, wrap;
+
+ again:
+    for(;;)
+    {
+	if(sc_plan_reserve(prv, read_atomic(&prv->nr_vcpus)))
+	    return;
+
+	spin_lock_irqsave(&prv->lock, flags);
+	if(prv->shadow->version == prv->plan_version)
+	{
+	    spin_unlock_irqrestore(&prv->lock, flags);
+	    return;
+	}
+	if(prv->nr_vcpus <= prv->plan_capacity)
+	    break;
+	spin_unlock_irqrestore(&prv->lock, flags);
+    }
+
+    next = sc_plan_scratch(prv);
+    from = sc_plan_snapshot(prv, next, full, &nr);
+    first = prv->dom0_cpu_count;
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    nr_cpus = next->nr_cpus;
+    end = prv->plan_vcpus + nr;
+
+    for(pv = prv->plan_vcpus; pv < end; pv++)
+    {
+	pv->next_assign = pv->assign;
+
+	// Only what sc_admit() let in gets a place
+	if(!pv->admitted)
+	    pv->next_assign.placed = 0;
+    }
+
+    if(full)
+	goto rebuild;
+
+    for(pv = prv->plan_vcpus; pv < end; pv++)
+    {
+	if(pv->assign.split)
+	    continue;
+
+	if(!dp_wrap_stay(next, sc_plan_bw(next, pv->bw), &pv->next_assign))
+	    pv->next_assign.placed = 0;
+    }
+
+    for(pv = prv->plan_vcpus; pv < end; pv++)
+    {
+	if(!pv->assign.split)
+	    continue;
+
+	if(!dp_wrap_stay(next, sc_plan_bw(next, pv->bw), &pv->next_assign))
+	    pv->next_assign.placed = 0;
+    }
+
+    for(pv = prv->plan_vcpus; pv < end; pv++)
+    {
+	if(pv->next_assign.placed || !pv->admitted)
+	    continue;
+
+	if(!dp_wrap_fill(next, sc_plan_bw(next, pv->bw), &pv->next_assign))
+	{
+	    // The rebuild needs every VCPU
+	    full = 1;
+	    goto again;
+	}
+    }
+
+    goto out;
+
+ rebuild:
+    for(wrap = 0; wrap < 2; wrap++)
+    {
+	for(r = first; r < nr_cpus; r++)
+	    sc_plan_set(next, next->fill[r], 0, 100000);
+
+	for(pv = prv->plan_vcpus; pv < end; pv++)
+	{
+	    if(!pv->admitted)
+		continue;
+
+	    if(wrap)
+		dp_wrap_place(next, sc_plan_bw(next, pv->bw), 100000, &pv->next_assign);
+	    else if(!dp_wrap_fill(next, sc_plan_bw(next, pv->bw), &pv->next_assign))
+		break;
+	}
+
+	if(pv == end)
+	    break;
+    }
+
+ out:
+    spin_lock_irqsave(&prv->lock, flags);
+    sc_plan_commit(prv, next, from, nr);
+    spin_unlock_irqrestore(&prv->lock, flags);
+}
+
+/*
+ * Make the shadow plan the one in use. A build still running started from
+ * the plan replaced, so it is thrown away. Called with prv->lock held.
+ */
+static void sc_plan_publish(struct sc_priv_info *prv)
+{
+    struct sc_plan *live = prv->plan;
+
+    write_atomic(&prv->plan, prv->shadow);
+    prv->shadow = live;
+    prv->plan_version++;
+    prv->plan_from = NR_CPUS;
+    prv->plan_moved = 0;
+}
+
+/* Builds the next plan during the current slice, off the scheduling path */
+static void sc_plan_tasklet(unsigned long data)
+{
+    const struct scheduler *ops = (const struct scheduler *)data;
+    struct sc_priv_info *prv = SC_PRIV(ops);
+
+    if(read_atomic(&prv->status) & SC_SHIFT)
+	sc_plan_build(prv);
+}
+
+/*
+ * The bandwidth of inf changed, or it joined or left the guests: the next
+ * plan has to be rebuilt from the first CPU it is on. Called with prv->lock
+ * held.
+ */
+static void sc_plan_dirty(struct sc_priv_info *prv, struct sc_vcpu_info *inf)
+{
+    int r;
+
+    if(!inf->assign.placed)
+	return;
+
+    r = prv->plan->rank[inf->assign.processor_a];
+    if(r < prv->plan_from)
+	prv->plan_from = r;
+}
+
+/*
+ * Something the next plan is built from changed. If a repartition is
+ * pending, have the plan rebuilt; sc_tasklet_cpu() runs the tasklet so the
+ * guest CPUs are not disturbed. Called with prv->lock held.
+ */
+static void sc_plan_invalidate(struct sc_priv_info *prv)
+{
+    prv->plan_version++;
+
+    if(prv->status & SC_SHIFT)
+	tasklet_schedule_on_cpu(&prv->plan_tasklet, sc_tasklet_cpu(prv));
+}
 
-		EDOM_INFO(v)->period_a = hperiod_total;
-		EDOM_INFO(v)->slice_a = hremainder; //FIXME: Hack to avoid overflows
+/*
+ * A guest's bandwidth change is in force from the global boundary at when:
+ * publish that in its shared info and have it sent VIRQ_RTVIRT. Called with
+ * prv->lock held.
+ */
+static void sc_notify_done(struct sc_priv_info *prv, struct sc_dom_info *sd, s_time_t when)
+{
+    struct shared_info *si = (struct shared_info *) sd->domain->shared_info;
 
-//		if(this_cpu != cpu_i)
-//		    pcpu_schedule_unlock(lock, cpu_i);
+    sd->done = sd->requested;
+    list_del_init(&sd->pending_elem);
 
-		if(HSLICE(cpu_i) > HPERIOD(cpu_i))
-		    printk("-- NOOP - Something bad happened: cpu: %d - s: %llu p: %llu --\n",
-			    cpu_i, HSLICE(cpu_i), HPERIOD(cpu_i));
+    write_atomic(&si->rtvirt_notify.effective, when);
+    smp_wmb();
+    write_atomic(&si->rtvirt_notify.done, sd->done);
 
-		cpu_i++;
-		last_assigned_pcpu = (cpu_i > last_assigned_pcpu ? cpu_i : last_assigned_pcpu);
+    if(list_empty(&sd->notify_elem))
+	list_add_tail(&sd->notify_elem, &prv->notify_list);
+    tasklet_schedule_on_cpu(&prv->notify_tasklet, sc_tasklet_cpu(prv));
+}
 
-//		lock = NULL;
+/*
+ * The guest of sd handed in a bandwidth change: give it the next ticket,
+ * which the hypercall leaves in its shared info. One that needs the CPUs
+ * repartitioned (shift) completes at the boundary that publishes the new
+ * plan, one that does not right away, unless an earlier one of the same
+ * guest is still waiting. Called with prv->lock held.
+ */
+static void sc_notify_request(struct sc_priv_info *prv, struct sc_dom_info *sd, int shift)
+{
+    struct shared_info *si = (struct shared_info *) sd->domain->shared_info;
 
-//		if(this_cpu != cpu_i)
-//		    while(!lock)
-//			lock = pcpu_schedule_trylock(cpu_i);
+    sd->requested++;
+    write_atomic(&si->rtvirt_notify.requested, sd->requested);
 
-		if(HSLICE(cpu_i) > HPERIOD(cpu_i))
-		    printk("-- NOOP - Something bad happened: cpu: %d - s: %llu p: %llu --\n", cpu_i, HSLICE(cpu_i), HPERIOD(cpu_i));
+    if(shift)
+    {
+	if(list_empty(&sd->pending_elem))
+	    list_add_tail(&sd->pending_elem, &prv->notify_pending);
+    }
+    else if(list_empty(&sd->pending_elem))
+	sc_notify_done(prv, sd, NOW());
+}
 
-		EDOM_INFO(v)->slice_b = HSLICE(cpu_i) = (vslice - hremainder);
-		EDOM_INFO(v)->period_b = HPERIOD(cpu_i) = hperiod_total;
-		EDOM_INFO(v)->processor_b = cpu_i;
-		EDOM_INFO(v)->status |= SC_SPLIT;
+/*
+ * Sends the VIRQs sc_notify_done() queued. Not under prv->lock: waking the
+ * guest's VCPU ends up in sc_wake(), which takes it.
+ */
+static void sc_notify_tasklet(unsigned long data)
+{
+    const struct scheduler *ops = (const struct scheduler *)data;
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    struct sc_dom_info *sd;
+    struct domain *d;
+    unsigned long flags;
 
-//		if(reverse_order_next > 0)
-//		    cpu_i--;
+    for ( ; ; )
+    {
+	spin_lock_irqsave(&prv->lock, flags);
+	if(list_empty(&prv->notify_list))
+	{
+	    spin_unlock_irqrestore(&prv->lock, flags);
+	    break;
+	}
 
-		if(v->processor != cpu_i)
-		{
-		    v->processor = cpu_i;
-//		    EDOM_INFO(v)->status |= SC_MIGRATED;
-		    //set_bit(_VPF_migrating, &v->pause_flags);
-		    list_move_tail(LIST(v), INACTIVEQ(cpu_i));
+	sd = list_entry(prv->notify_list.next, struct sc_dom_info, notify_elem);
+	list_del_init(&sd->notify_elem);
+	d = sd->domain;
+	// A dying domain is not told any more
+	if(!get_domain(d))
+	    d = NULL;
+	spin_unlock_irqrestore(&prv->lock, flags);
 
-		    if(CPU_INFO(cpu_i)->new_gl_d == 0)
-			CPU_INFO(cpu_i)->new_gl_d = global_deadline;
+	if(d != NULL)
+	{
+	    send_guest_global_virq(d, VIRQ_RTVIRT);
+	    put_domain(d);
+	}
+    }
+}
 
-		    cpu_raise_softirq(v->processor, SCHEDULE_SOFTIRQ);
-		}
-		else
-		{
-		    v->processor = cpu_i;
-		    list_move_tail(LIST(v), INACTIVEQ(cpu_i));
-		}
+/* Place a VCPU on the plan in use right away. Called with prv->lock held. */
+static int dp_wrap_assign_pcpu(struct vcpu *v, const struct scheduler *ops)
+{
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    struct sc_assignment a;
+    int placed;
 
-	    }
-	    else
-	    {
-		HSLICE(cpu_i) = 100000;
-		HPERIOD(cpu_i) = 100000;
+    DPRINTK("------ CPU: %d - %s - %d ------\n",
+	    smp_processor_id(),
+	    __func__,
+	    __LINE__);
 
-		if(v->processor != cpu_i)
-		{
-		    v->processor = cpu_i;
-		    EDOM_INFO(v)->processor_a = cpu_i;
-//		    EDOM_INFO(v)->status |= SC_MIGRATED;
-		    last_assigned_pcpu = (cpu_i > last_assigned_pcpu ? cpu_i : last_assigned_pcpu);
-		    //set_bit(_VPF_migrating, &v->pause_flags);
-		    list_move_tail(LIST(v), INACTIVEQ(cpu_i));
-		    cpu_raise_softirq(v->processor, SCHEDULE_SOFTIRQ);
-		}
-		else
-		{
-		    v->processor = cpu_i;
-		    EDOM_INFO(v)->processor_a = cpu_i;
-		    list_move_tail(LIST(v), INACTIVEQ(cpu_i));
-		}
-	    }
-	}
+    sc_plan_reorder(prv);
 
-	if(EDOM_INFO(v)->status & SC_SPLIT)
-	{
-	    DPRINTK("-- Check2 - CPU: %d - ID:%d.%d - cpu1: %d - cpu2: %d - slice_a: %lld - period_a: %lld - slice_b: %lld: - period_b: %lld --\n",
-		    smp_processor_id(),
-		    v->domain->domain_id,
-		    v->vcpu_id,
-		    EDOM_INFO(v)->processor_a,
-		    EDOM_INFO(v)->processor_b,
-		    (long long) EDOM_INFO(v)->slice_a,
-		    (long long) EDOM_INFO(v)->period_a,
-		    (long long) EDOM_INFO(v)->slice_b,
-		    (long long) EDOM_INFO(v)->period_b);
-	}
-	else
-	{
-	    DPRINTK("-- Check2 - CPU: %d - ID:%d.%d - cpu1: %d - slice_a: %lld - period_a: %lld --\n",
-		    smp_processor_id(),
-		    v->domain->domain_id,
-		    v->vcpu_id,
-		    v->processor,
-		    (long long) EDOM_INFO(v)->slice_new,
-		    (long long) EDOM_INFO(v)->period_new);
-	}
+    // The plan in use may have holes, which dp_wrap_place() cannot fill
+    placed = dp_wrap_fill(prv->plan, EDOM_INFO(v)->slice_new, &a);
+    dp_wrap_apply(prv, v, &a);
+    sc_kick(prv);
 
-//	if(this_cpu != cpu_i)
-//	    pcpu_schedule_unlock(lock, cpu_i);
+    // The shadow plan copies the CPUs ranked before plan_from from this one
+    sc_plan_dirty(prv, EDOM_INFO(v));
+    sc_plan_invalidate(prv);
 
-	// -> spin_unlock_irqrestore(&prv->lock, flags);
-	return 1;
-    }
-    // -> spin_unlock_irqrestore(&prv->lock, flags);
-    return 0;
+    return placed;
 }
 
-static struct list_head deadline_queue; // FIXME: This creates one for each CPU. It should be one global one!
-
 static void tell_vcpus_to_find_new_pcpus(struct vcpu *v, struct sc_barrier_t* b, const struct scheduler *ops)
 {
     //struct sc_vcpu_info *curinf;
    // struct list_head     *cur, *tmp;
     struct sc_priv_info *prv = SC_PRIV(ops);
 
-    printk("------ CPU: %d - %s - %d ------\n", smp_processor_id(), __func__, __LINE__);
-
     if(prv->status & SC_SHIFT)
 	return;
 
     prv->status |= SC_SHIFT;
+    tasklet_schedule_on_cpu(&prv->plan_tasklet, sc_tasklet_cpu(prv));
 
     //curinf = list_entry(sc_list_head.prev, struct sc_vcpu_info, sc_list);
     //atomic_set(&b->cpu_count, last_assigned_pcpu);
@@ -1008,12 +2297,115 @@ static void tell_vcpus_to_find_new_pcpus(struct vcpu *v, struct sc_barrier_t* b,
 }
 
 /*
- * FIXME: We don't do error checking yet, to ensure that we have bandwidth
- * left.
+ * Put a guest VCPU on sc_list_head, which every plan is built from. One that
+ * was admitted but has no place in the plan in use yet gets one at the next
+ * boundary. Called with prv->lock held.
+ */
+static void sc_list_join(const struct scheduler *ops, struct vcpu *v)
+{
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    struct sc_vcpu_info *inf = EDOM_INFO(v);
+
+    if(__task_on_sclist(v) || v->domain->domain_id == 0)
+	return;
+
+    list_add_tail(&inf->sc_list, &prv->sc_list_head);
+    sc_plan_dirty(prv, inf);
+    sc_plan_invalidate(prv);
+
+    if(inf->rate && !inf->assign.placed)
+	tell_vcpus_to_find_new_pcpus(v, &prv->cpu_barrier, ops);
+}
+
+/*
+ * Bandwidth of slice every period (ns) in 1/100000 of a CPU, as slice_new
+ * holds it. Dom0's VCPUs have CPUs of their own and take none from the
+ * guests.
+ */
+static inline s_time_t sc_bw(struct vcpu *v, s_time_t period, s_time_t slice)
+{
+    if(v->domain->domain_id == 0)
+	return 0;
+
+    return (100000 * (slice / 1000)) / (period / 1000);
+}
+
+/*
+ * How many global boundaries a second a VCPU with this period can bring:
+ * one per deadline at most. Every boundary switches each VCPU in again.
+ */
+static inline s_time_t sc_rate(struct vcpu *v, s_time_t period)
+{
+    if(v->domain->domain_id == 0)
+	return 0;
+
+    return DIV_UP(SECONDS(1), period);
+}
+
+/*
+ * Bandwidth switching takes from nr guest VCPUs whose deadlines bring up to
+ * rate boundaries a second: each VCPU is switched in once per global slice,
+ * and the split ones, at most one per guest CPU but the last, handed off
+ * once more. Priced at the worst costs measured so far, at no more
+ * boundaries than sc_boundary_rate() allows.
+ */
+static s_time_t sc_overhead(struct sc_priv_info *prv, s_time_t nr, s_time_t rate)
+{
+    s_time_t splits = min((s_time_t)sc_guest_cpus(prv) - 1, nr);
+
+    if(splits < 0)
+	splits = 0;
+
+    return (nr * sc_switch_cost(prv, 0) + splits * sc_switch_cost(prv, 1)) *
+	sc_boundary_rate(prv, rate) / 10000;
+}
+
+/*
+ * Admission test: do the guests still fit on the CPUs dom0 leaves them if
+ * request replaces release, and nr guest VCPUs with a total rate are left
+ * to switch between? DP-Wrap can schedule any set of VCPUs whose bandwidths
+ * add up to no more than that, so the sum is the whole check and nothing
+ * has to be placed to answer it. Giving bandwidth back is always let
+ * through. On -ENOSPC the most request could have been goes in *left, in
+ * 1/100000 CPU, if left is not NULL. Called with prv->lock held.
  */
+static int sc_admit(struct sc_priv_info *prv, s_time_t release, s_time_t request,
+	s_time_t nr, s_time_t rate, uint32_t *left)
+{
+    s_time_t room;
+
+    room = sc_capacity(prv) - (prv->bw_admitted - release) -
+	sc_overhead(prv, nr, rate);
+    if(request <= room || request <= release)
+	return 0;
+
+    room = max(room, release);
+    TRACE_3D(TRC_RTVIRT_REFUSE, (uint32_t)request, (uint32_t)room, sc_guest_cpus(prv));
+    if(left != NULL)
+	*left = room;
+
+    return -ENOSPC;
+}
+
+/* Count v in with the bandwidth and rate it has just been admitted for */
+static void sc_admitted(struct sc_priv_info *prv, struct sc_vcpu_info *inf, s_time_t bw, s_time_t rate)
+{
+    prv->bw_admitted += bw - inf->bw;
+    prv->rate_admitted += rate - inf->rate;
+    prv->nr_admitted += !!rate - !!inf->rate;
+    inf->bw = bw;
+    inf->rate = rate;
+}
 
 static void sc_insert_vcpu(const struct scheduler *ops, struct vcpu *v)
 {
+    struct sc_vcpu_info *inf = EDOM_INFO(v);
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    unsigned long flags;
+    s_time_t bw, rate;
+    unsigned int cpu;
+    uint32_t left;
+
     DPRINTK("------ CPU: %d - ID: %6d.%d - %s ------\n",
 	    smp_processor_id(),
 	    v->domain->domain_id,
@@ -1028,10 +2420,41 @@ static void sc_insert_vcpu(const struct scheduler *ops, struct vcpu *v)
 	v->processor = v->vcpu_id;
     else if(!(EDOM_INFO(v)->status & SC_SHUTDOWN))
     {
+	spin_lock_irqsave(&prv->lock, flags);
+
+	// Until it is placed it waits on the first CPU of this instance
+	cpu = cpumask_first(&prv->cpumask);
+	if(cpu < nr_cpu_ids)
+	    v->processor = cpu;
+
+	// Dom0's CPUs come first in the fill order
 	if(v->domain->domain_id == 0)
-	    dom0_cpu_count++;
-	v->processor = 0;
-	dp_wrap_assign_pcpu(v, ops);
+	{
+	    prv->dom0_cpu_count++;
+	    prv->plan_reorder = 1;
+	}
+
+	bw = sc_bw(v, inf->period, inf->slice);
+	rate = sc_rate(v, inf->period);
+	if(sc_admit(prv, 0, bw, prv->nr_admitted + !!rate, prv->rate_admitted + rate, &left))
+	{
+	    // Left unplaced, so it does not run until an sc_adjust() that fits
+	    // repartitions for it: nobody asked, so the console is told
+	    printk("--- d%dv%d not admitted: %ld of %u left, in 1/100000 CPU ---\n",
+		    v->domain->domain_id, v->vcpu_id, bw, left);
+	    inf->status &= ~SC_DEFAULT;
+	}
+	else
+	{
+	    sc_admitted(prv, inf, bw, rate);
+	    dp_wrap_assign_pcpu(v, ops);
+	}
+
+	// On sc_list from the start, so no plan built before it first wakes
+	// leaves it out
+	sc_list_join(ops, v);
+
+	spin_unlock_irqrestore(&prv->lock, flags);
     }
 
     if ( is_idle_vcpu(v) )
@@ -1046,27 +2469,47 @@ static void sc_remove_vcpu(const struct scheduler *ops, struct vcpu *v)
 {
     struct list_head *list;
     struct sc_vcpu_info *inf     = EDOM_INFO(v);
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    struct sc_cpu_info *spc;
+    unsigned long flags;
+    int i;
 
     DPRINTK("------ CPU: %d - %s ------\n",
 	    smp_processor_id(),
 	    __func__);
 
+    spin_lock_irqsave(&prv->lock, flags);
+
     inf->status |= SC_SHUTDOWN;
 
-    list = D_LIST(v);
-    list_del(list);
+    heapDelete(&prv->deadline_heap, inf);
 
-    //deleteNode(inf);
     list = LIST(v);
     list_del(list);
 
     list = SC_LIST(v);
     list_del(list);
+
+    // Whatever is allocated in its place must not inherit its slot, which
+    // a split VCPU may have on the CPU it left
+    list_for_each_entry ( spc, &prv->cpus, cpu_elem )
+	for(i = 0; i < spc->nr_slots; i++)
+	    if(spc->slots[i].inf == inf)
+		spc->slots[i].inf = NULL;
+
+    sc_admitted(prv, inf, 0, 0);
+
+    sc_plan_dirty(prv, inf);
+    sc_plan_invalidate(prv);
+
+    spin_unlock_irqrestore(&prv->lock, flags);
 }
 
 static void *sc_alloc_vdata(const struct scheduler *ops, struct vcpu *v, void *dd)
 {
     struct sc_vcpu_info *inf;
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    unsigned long flags;
 
     DPRINTK("------ CPU: %d - ID: %6d.%d - %s ------\n",
 	    smp_processor_id(),
@@ -1078,12 +2521,30 @@ static void *sc_alloc_vdata(const struct scheduler *ops, struct vcpu *v, void *d
     if ( inf == NULL )
 	return NULL;
 
+    // Another VCPU may take the room reserved before the lock is held again
+    for(;;)
+    {
+	if ( heapReserve(&prv->deadline_heap, &prv->lock, read_atomic(&prv->nr_vcpus) + 1) )
+	{
+	    xfree(inf);
+	    return NULL;
+	}
+
+	spin_lock_irqsave(&prv->lock, flags);
+	if(prv->nr_vcpus < prv->deadline_heap.capacity)
+	    break;
+	spin_unlock_irqrestore(&prv->lock, flags);
+    }
+    prv->nr_vcpus++;
+    spin_unlock_irqrestore(&prv->lock, flags);
 
     inf->vcpu = v;
 
     inf->local_cputime = 0;
     inf->local_deadl = 0;
     inf->deadl_abs   = 0;
+    inf->heap_index  = -1;
+    inf->last_cpu    = -1;
     inf->status      = SC_ASLEEP | SC_INACTIVE;
     inf->extraweight = 0;
     inf->weight = 0;
@@ -1113,9 +2574,9 @@ static void *sc_alloc_vdata(const struct scheduler *ops, struct vcpu *v, void *d
 
     inf->slice_new = (100000 * inf->slice_new) / inf->period_new;
     inf->period_new = 100000;
+    sc_update_shares(inf);
 
     INIT_LIST_HEAD(&(inf->list));
-    INIT_LIST_HEAD(&(inf->d_list));
     INIT_LIST_HEAD(&(inf->sc_list));
 
     return inf;
@@ -1125,6 +2586,8 @@ static void *sc_alloc_vdata(const struct scheduler *ops, struct vcpu *v, void *d
 sc_alloc_pdata(const struct scheduler *ops, int cpu)
 {
     struct sc_cpu_info *spc;
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    unsigned long flags;
 
     DPRINTK("------ CPU: %d - %s ------\n",
 	    smp_processor_id(),
@@ -1136,23 +2599,31 @@ sc_alloc_pdata(const struct scheduler *ops, int cpu)
     INIT_LIST_HEAD(&spc->waitq);
     INIT_LIST_HEAD(&spc->inactiveq);
     INIT_LIST_HEAD(&spc->migratedq);
-    spc->hyper_slice = 0;
-    spc->hyper_period = 100000;
+    sc_plan_set(prv->plan, cpu, 0, 100000);
+    spc->fill_next = cpu;
     spc->new_gl_d = 0;
-    spc->d_array_index = 0;
-    spc->print_index = 0;
     spc->current_slice_expires = 0;
     spc->allocated_time = 0;
 
     spc->used_slice = 0;
     spc->used_period = 10000;
 
+    spin_lock_irqsave(&prv->lock, flags);
+    list_add_tail(&spc->cpu_elem, &prv->cpus);
+    cpumask_set_cpu(cpu, &prv->cpumask);
+    prv->plan_reorder = 1;
+    spin_unlock_irqrestore(&prv->lock, flags);
+
     return (void *)spc;
 }
 
     static void
-sc_free_pdata(const struct scheduler *ops, void *spc, int cpu)
+sc_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 {
+    struct sc_cpu_info *spc = pcpu;
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    unsigned long flags;
+
     DPRINTK("------ CPU: %d - %s ------\n",
 	    smp_processor_id(),
 	    __func__);
@@ -1160,26 +2631,53 @@ sc_free_pdata(const struct scheduler *ops, void *spc, int cpu)
     if ( spc == NULL )
 	return;
 
+    spin_lock_irqsave(&prv->lock, flags);
+    list_del(&spc->cpu_elem);
+    cpumask_clear_cpu(cpu, &prv->cpumask);
+    prv->plan_reorder = 1;
+    spin_unlock_irqrestore(&prv->lock, flags);
+
     xfree(spc);
 }
 
 static void sc_free_vdata(const struct scheduler *ops, void *priv)
 {
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    unsigned long flags;
+
     DPRINTK("------ CPU: %d - %s ------\n",
 	    smp_processor_id(),
 	    __func__);
 
+    if ( priv == NULL )
+	return;
+
+    spin_lock_irqsave(&prv->lock, flags);
+    heapDelete(&prv->deadline_heap, priv);
+    prv->nr_vcpus--;
+    spin_unlock_irqrestore(&prv->lock, flags);
+
     xfree(priv);
 }
 
     static void *
 sc_alloc_domdata(const struct scheduler *ops, struct domain *d)
 {
+    struct sc_dom_info *sd;
+
     DPRINTK("------ CPU: %d - %s ------\n",
 	    smp_processor_id(),
 	    __func__);
 
-    return xzalloc(struct sc_dom_info);
+    sd = xzalloc(struct sc_dom_info);
+    if ( sd == NULL )
+	return NULL;
+
+    sd->domain = d;
+    INIT_LIST_HEAD(&sd->pending_elem);
+    INIT_LIST_HEAD(&sd->notify_elem);
+
+    return sd;
 }
 
 static int sc_init_domain(const struct scheduler *ops, struct domain *d)
@@ -1198,11 +2696,24 @@ static int sc_init_domain(const struct scheduler *ops, struct domain *d)
 
 static void sc_free_domdata(const struct scheduler *ops, void *data)
 {
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    struct sc_dom_info *sd = data;
+    unsigned long flags;
+
     DPRINTK("------ CPU: %d - %s ------\n",
 	    smp_processor_id(),
 	    __func__);
 
-    xfree(data);
+    if ( sd == NULL )
+	return;
+
+    // Nothing is sent for a domain that is going away
+    spin_lock_irqsave(&prv->lock, flags);
+    list_del(&sd->pending_elem);
+    list_del(&sd->notify_elem);
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+    xfree(sd);
 }
 
 static void sc_destroy_domain(const struct scheduler *ops, struct domain *d)
@@ -1246,11 +2757,10 @@ static int sc_pick_cpu(const struct scheduler *ops, struct vcpu *v)
     return v->processor;
 }
 
-static s_time_t global_slice_start = 0;
-
 static int sc_init(struct scheduler *ops)
 {
     struct sc_priv_info *prv;
+    int i, j;
 
     DPRINTK("------ CPU: %d - %s ------\n",
 	    smp_processor_id(),
@@ -1264,16 +2774,43 @@ static int sc_init(struct scheduler *ops)
     spin_lock_init(&prv->lock);
     init_sc_barrier(&prv->cpu_barrier);
     prv->status = 0;
-    INIT_LIST_HEAD(&deadline_queue);
-    INIT_LIST_HEAD(&sc_list_head);
+
+    // Until the CPUs come up they are filled in the order of their ids
+    for(i = 0; i < NR_CPUS; i++)
+	for(j = 0; j < ARRAY_SIZE(prv->plans); j++)
+	{
+	    prv->plans[j].fill[i] = prv->plans[j].rank[i] = i;
+	    sc_plan_set(&prv->plans[j], i, 0, 100000);
+	}
+    for(j = 0; j < ARRAY_SIZE(prv->plans); j++)
+	prv->plans[j].full = SC_FULL_SLACK;
+    prv->plan = &prv->plans[0];
+    prv->shadow = &prv->plans[1];
+    prv->plan_version = 1;
+    tasklet_init(&prv->plan_tasklet, sc_plan_tasklet, (unsigned long)ops);
+    tasklet_init(&prv->trace_tasklet, sc_trace_tasklet, (unsigned long)ops);
+    tasklet_init(&prv->notify_tasklet, sc_notify_tasklet, (unsigned long)ops);
+    INIT_LIST_HEAD(&prv->notify_pending);
+    INIT_LIST_HEAD(&prv->notify_list);
+    INIT_LIST_HEAD(&prv->sc_list_head);
+    prv->reverse_order_next = 1;
+    INIT_LIST_HEAD(&prv->cpus);
     sc_debugging = 4;
 
+    prv->min_global_slice = SC_MIN_GLOBAL_SLICE;
+    prv->shift_delay = SC_SHIFT_DELAY;
+    prv->full_slack = SC_FULL_SLACK;
+    prv->extra_quantum = EXTRA_QUANTUM;
+    if(sched_sc_calibrate)
+	sc_calibrate_start(prv);
+
     return 0;
 }
 
 static void sc_deinit(const struct scheduler *ops)
 {
     struct sc_priv_info *prv;
+    int i;
 
     DPRINTK("------ CPU: %d - %s ------\n",
 	    smp_processor_id(),
@@ -1281,7 +2818,16 @@ static void sc_deinit(const struct scheduler *ops)
 
     prv = SC_PRIV(ops);
     if ( prv != NULL )
+    {
+	tasklet_kill(&prv->plan_tasklet);
+	tasklet_kill(&prv->trace_tasklet);
+	tasklet_kill(&prv->notify_tasklet);
+	for(i = 0; i < NR_CPUS; i++)
+	    xfree(prv->trace[i]);
+	xfree(prv->deadline_heap.nodes);
+	xfree(prv->plan_vcpus);
 	xfree(prv);
+    }
 }
 /*
 static s_time_t get_last_local_deadl(struct sc_vcpu_info *inf)
@@ -1355,36 +2901,46 @@ static int sc_active(struct sc_vcpu_info *inf, s_time_t now)
 }
 
 
-static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct scheduler *ops)
+/*
+ * Lay out cpu's runq over the global slice from start to deadline, which
+ * the caller read as one published boundary.
+ */
+static void calculate_new_local_deadlines(int cpu, s_time_t now, s_time_t start,
+	s_time_t deadline, const struct scheduler *ops)
 {
     //struct list_head     *migq     = MIGQ(cpu);
-    int array_index;
     struct list_head     *runq     = RUNQ(cpu);
     struct list_head     *waitq     = WAITQ(cpu);
     struct list_head     *inactiveq = INACTIVEQ(cpu);
     struct list_head     *cur, *tmp;
     struct sc_vcpu_info *curinf, *first;
-    s_time_t slice_length = global_deadline - (global_slice_start);
+    struct sc_cpu_info *spc = CPU_INFO(cpu);
+    struct sc_slot *slot;
+    struct sc_trace_rec *trc;
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    s_time_t slice_length = deadline - start;
     //s_time_t              new_now = NOW();
     //s_time_t slice_length = global_deadline - now;
-    s_time_t prev, curr;
-    struct shared_info *si;
+    s_time_t prev, curr, offset, length;
+    u64 share;
     int loop_detection = 0;
 
     if(sc_debugging == 1)
     {
-	if(CPU_INFO(cpu)->d_array_index < DEBUG_LINES)
+	trc = sc_trace_get(prv, cpu);
+	if(trc != NULL)
 	{
-	    array_index = CPU_INFO(cpu)->d_array_index;
-	    CPU_INFO(cpu)->d_array[array_index].domid = 0;
-	    CPU_INFO(cpu)->d_array[array_index].vcpuid = 0;
-	    CPU_INFO(cpu)->d_array[array_index].now_time = now;
-	    CPU_INFO(cpu)->d_array[array_index].ret_time = 0;
-	    CPU_INFO(cpu)->d_array[array_index].slice_time = slice_length;
-	    CPU_INFO(cpu)->d_array[array_index].alloc = CPU_INFO(cpu)->allocated_time;
-	    CPU_INFO(cpu)->allocated_time = 0;
-	    CPU_INFO(cpu)->d_array_index++;
+	    trc->stamp = now;
+	    trc->event = SC_TRC_BOUNDARY;
+	    trc->domid = 0;
+	    trc->vcpuid = 0;
+	    trc->ret_time = 0;
+	    trc->cputime = sc_trace_ns(slice_length);
+	    trc->alloc = sc_trace_ns(CPU_INFO(cpu)->allocated_time);
+	    trc->cost = 0;
+	    sc_trace_put(prv, cpu);
 	}
+	CPU_INFO(cpu)->allocated_time = 0;
     }
 
     /*
@@ -1418,8 +2974,11 @@ static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct sc
 
     list_for_each_safe ( cur, tmp, waitq )
     {
-	if(loop_detection++ > 20)
+	if(SC_LIST_CORRUPT(prv, ++loop_detection))
+	{
 	    printk("**** OOPS: Caught in an infinite loop: %d *****\n", __LINE__);
+	    break;
+	}
 
 	curinf = list_entry(cur, struct sc_vcpu_info, list);
 
@@ -1468,8 +3027,11 @@ static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct sc
     // VM is started at the beginning of the queue of processor_a.
     list_for_each_safe ( cur, tmp, inactiveq )
     {
-	if(loop_detection++ > 20)
+	if(SC_LIST_CORRUPT(prv, ++loop_detection))
+	{
 	    printk("**** OOPS: Caught in an infinite loop: %d *****\n", __LINE__);
+	    break;
+	}
 
 	curinf = list_entry(cur, struct sc_vcpu_info, list);
 	curinf->status &= ~SC_INACTIVE;
@@ -1490,15 +3052,24 @@ static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct sc
     loop_detection = 0;
 
 
-    prev = global_slice_start;
-
     if(!list_empty(runq))
 	first = list_entry(runq->next, struct sc_vcpu_info, list);
 
+    prev = start;
+
+    // The walk also fills this CPU's slot table, which sc_do_schedule()
+    // dispatches from until the next boundary
+    spc->slot_start = start;
+    spc->nr_slots = 0;
+    spc->slot_next = 0;
+
     list_for_each_safe ( cur, tmp, runq )
     {
-	if(loop_detection++ > 20)
+	if(SC_LIST_CORRUPT(prv, ++loop_detection))
+	{
 	    printk("**** OOPS: Caught in an infinite loop: %d *****\n", __LINE__);
+	    break;
+	}
 
 	curinf = list_entry(cur,struct sc_vcpu_info,list);
 
@@ -1508,7 +3079,7 @@ static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct sc
 	    printk("------ CPU: %d - NOW: %ld - global_deadline: %ld - ID: %6d.%d - assigned cpu: %d - deadl: %ld - migrated: %d ------\n",
 		    cpu,
 		    now,
-		    global_deadline,
+		    prv->global_deadline,
 		    curinf->vcpu->domain->domain_id,
 		    curinf->vcpu->vcpu_id,
 		    curinf->vcpu->processor,
@@ -1519,11 +3090,9 @@ static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct sc
 
 	if(curinf->status & SC_RESET)
 	{
-	    si = (struct shared_info *) curinf->vcpu->domain->shared_info;
-
 	    curinf->status &= ~SC_RESET;
 
-	    // If extra_arg5 is zero, that means the guest didn't confirm the
+	    // If no RTA is running in the guest, that means it didn't confirm the
 	    // arrival, and so we reset the SC_ARRIVED flag, so that Xen
 	    // can accept the next signal (vcpu_wake call) as the arrival.
 	    // Ideally if this is done, we should also ignore the deadline
@@ -1544,6 +3113,29 @@ static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct sc
 	else
 	 */   curinf->local_cputime = 0;
 
+	// A split VCPU's share here is that of the side that runs first on
+	// this CPU, see below.
+	if(!(curinf->status & SC_SPLIT))
+	    share = curinf->share_new;
+	else if(prv->reverse_order_next < 0)
+	    share = curinf->share_a;
+	else
+	    share = curinf->share_b;
+
+	curr = sc_scale(share, slice_length);
+
+	offset = prev - start;
+	length = curr;
+	prev += curr;
+
+	if(spc->nr_slots < SC_SLOTS)
+	{
+	    slot = &spc->slots[spc->nr_slots++];
+	    slot->inf = curinf;
+	    slot->offset = offset;
+	    slot->length = length;
+	}
+
 	if(curinf->status & SC_SPLIT)
 	{
 	    // When we are in Reverse Order now, the VM will
@@ -1553,7 +3145,7 @@ static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct sc
 	    // Essentially, the current reverse_order tells us
 	    // in which RUNQ the VM ended up in before this
 	    // function was called.
-	    if(reverse_order_next < 0)
+	    if(prv->reverse_order_next < 0)
 	    {
 		if(curinf->processor_a != cpu)
 		{
@@ -1563,22 +3155,17 @@ static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct sc
 			    curinf->processor_a, cpu);
 		}
 
-		curr = (curinf->slice_a * slice_length);
-		curr /= curinf->period_a;
-
-		curinf->local_slice = curr + curinf->local_cputime;
-		curinf->local_cputime = curinf->local_slice;
-		prev = curinf->local_deadl = prev + curinf->local_cputime;
+		curinf->local_slice = length;
+		curinf->local_deadl = prev;
 
-		curinf->local_slice -= 500;
+		curinf->local_slice -= CPU_INFO(cpu)->switch_cost;
 		curinf->local_cputime = curinf->local_slice;
 
 		curinf->status |= SC_MIGRATING;
 
-		curr = (curinf->slice_b * slice_length);
-		curr /= curinf->period_b;
+		curr = sc_scale(curinf->share_b, slice_length);
 
-		curinf->local_deadl_second = global_deadline;
+		curinf->local_deadl_second = deadline;
 		curinf->local_slice_second = curr;
 	    }
 	    else
@@ -1591,35 +3178,26 @@ static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct sc
 			    curinf->processor_b, cpu);
 		}
 
-		curr = (curinf->slice_b * slice_length);
-		curr /= curinf->period_b;
-
-		curinf->local_slice_second = curr + curinf->local_cputime;
-		curinf->local_cputime = curinf->local_slice_second;
-		prev = curinf->local_deadl_second = prev + curinf->local_cputime;
+		curinf->local_slice_second = length;
+		curinf->local_deadl_second = prev;
 
-		curinf->local_slice_second -= 500;
+		curinf->local_slice_second -= CPU_INFO(cpu)->switch_cost;
 		curinf->local_cputime = curinf->local_slice_second;
 
 		curinf->status |= SC_MIGRATING;
 
-		curr = (curinf->slice_a * slice_length);
-		curr /= curinf->period_a;
+		curr = sc_scale(curinf->share_a, slice_length);
 
-		curinf->local_deadl = global_deadline;
+		curinf->local_deadl = deadline;
 		curinf->local_slice = curr;
 	    }
 	}
 	else
 	{
-	    curr = (curinf->slice_new * slice_length);
-	    curr /= curinf->period_new;
-
-	    curinf->local_slice = curr + curinf->local_cputime;
-	    curinf->local_cputime = curinf->local_slice;
-	    prev = curinf->local_deadl = prev + curinf->local_cputime;
+	    curinf->local_slice = length;
+	    curinf->local_deadl = prev;
 
-	    curinf->local_slice -= 500;
+	    curinf->local_slice -= CPU_INFO(cpu)->switch_cost;
 	    curinf->local_cputime = curinf->local_slice;
 	}
 /*
@@ -1632,15 +3210,22 @@ static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct sc
 		DPRINTK_ERR("[%d] *** BAD2 ***, assigning local_deadl_second that is before NOW - Diff: %ld ***\n", cpu, (now - curinf->local_deadl_second));
 	}
 */
+	// A split VCPU's other side is only laid out on its other CPU once it
+	// migrates there, so its length goes in this record.
+	TRACE_5D(TRC_RTVIRT_SLICE,
+		curinf->vcpu->domain->domain_id, curinf->vcpu->vcpu_id,
+		(uint32_t)offset, (uint32_t)length,
+		(curinf->status & SC_SPLIT) ? (uint32_t)curr : 0);
+
 	if(cpu == 0)
 	    DPRINTK2("- CPU: %d - NOW: %ld - gl. deadl.: %ld - ID: %6d.%d - lcl. deadl: %ld - slice: %lu -\n",
 		    cpu,
 		    now,
-		    global_deadline,
+		    prv->global_deadline,
 		    curinf->vcpu->domain->domain_id,
 		    curinf->vcpu->vcpu_id,
 		    get_local_deadl(curinf),
-		    curr);
+		    length);
 
 	//if(!vcpu_runnable(curinf->vcpu) )
 	//    list_move(LIST(curinf->vcpu), waitq);
@@ -1662,7 +3247,6 @@ static void calculate_new_local_deadlines(int cpu, s_time_t now, const struct sc
 
 static void update_queues(int cpu, s_time_t now, const struct scheduler *ops)
 {
-    struct shared_info *si;
     struct sc_priv_info *prv = SC_PRIV(ops);
     //struct list_head     *migq     = MIGQ(cpu);
     struct list_head     *runq     = RUNQ(cpu);
@@ -1672,19 +3256,22 @@ static void update_queues(int cpu, s_time_t now, const struct scheduler *ops)
     int migrate_to_processor;
     spinlock_t *lock;
     int loop_detection = 0;
+    /* CPUs VCPUs migrated to, kicked all at once on the way out */
+    cpumask_t kick;
 
     //DPRINTK3("------ Line: %d - CPU: %d - %s ------\n", __LINE__, smp_processor_id(), __func__);
 
-    if(prv->status & SC_CPU0_BUSY)
+    if(sc_boundary_busy(prv))
 	return;
 
+    cpumask_clear(&kick);
 
     list_for_each_safe ( cur, tmp, runq )
     {
-	if(prv->status & SC_CPU0_BUSY)
+	if(sc_boundary_busy(prv))
 	   break;
 
-	if(loop_detection++ > 25)
+	if(SC_LIST_CORRUPT(prv, ++loop_detection))
 	{
 	    printk("**** OOPS: Caught in an infinite loop: %d *****\n", __LINE__);
 	    break;
@@ -1709,7 +3296,11 @@ static void update_queues(int cpu, s_time_t now, const struct scheduler *ops)
 
 		list_move(LIST(inf->vcpu), waitq);
 	    }
-	    else if(inf->status & SC_SPLIT && inf->status & SC_MIGRATING && (inf->local_cputime - 500) < 0)
+	    // Once what is left here would not even cover getting it
+	    // running on its other CPU, it goes there
+	    else if(inf->status & SC_SPLIT && inf->status & SC_MIGRATING &&
+		    inf->local_cputime < CPU_INFO(inf->vcpu->processor == inf->processor_a ?
+			inf->processor_b : inf->processor_a)->handoff_cost)
 	    {
 		// TODO: Needs locking to access/modify runqueues of other PCPUs
 		if(inf->vcpu->processor == inf->processor_a)
@@ -1740,6 +3331,10 @@ static void update_queues(int cpu, s_time_t now, const struct scheduler *ops)
 		    //while(!lock)
 		    //   lock = pcpu_schedule_trylock(migrate_to_processor);
 
+		    TRACE_4D(TRC_RTVIRT_MIGRATE,
+			    inf->vcpu->domain->domain_id, inf->vcpu->vcpu_id,
+			    inf->vcpu->processor, migrate_to_processor);
+
 		    inf->vcpu->processor = migrate_to_processor;
 		    inf->status |= SC_MIGRATED;
 		    list_move_tail(LIST(inf->vcpu), MIGQ(inf->vcpu->processor));
@@ -1751,7 +3346,7 @@ static void update_queues(int cpu, s_time_t now, const struct scheduler *ops)
 		    if(CPU_INFO(inf->vcpu->processor)->new_gl_d == 0 || CPU_INFO(inf->vcpu->processor)->current_slice_expires == 0 ||
 			    is_idle_vcpu(per_cpu(schedule_data, inf->vcpu->processor).curr) ||
 			    (EDOM_INFO(per_cpu(schedule_data, inf->vcpu->processor).curr)->local_cputime < 0))
-			cpu_raise_softirq(inf->vcpu->processor, SCHEDULE_SOFTIRQ);
+			cpumask_set_cpu(inf->vcpu->processor, &kick);
 		}
 		else
 		    printk("--- NOPE --- migrating to the same CPU --- \n");
@@ -1766,37 +3361,6 @@ static void update_queues(int cpu, s_time_t now, const struct scheduler *ops)
 	    //	list_move_tail(LIST(inf->vcpu), runq);
 	    //  }
 
-	    si = (struct shared_info *) inf->vcpu->domain->shared_info;
-
-	    if(si->extra_arg1[inf->vcpu->vcpu_id] > 0)
-	    {
-		if(si->extra_arg1[inf->vcpu->vcpu_id] == 1)
-		{
-		    if(inf->status & SC_SPORADIC)
-		    {
-			//if(!(inf->status & SC_ARRIVED))
-			//{
-			//    inf->status |= SC_ARRIVED;
-
-			/*
-			printk("-------- ARR - Got from %d.%d --- Used Time: %ld - Diff: %ld - Now: %ld --\n",
-				inf->vcpu->domain->domain_id,
-				inf->vcpu->vcpu_id,
-				inf->cputime,
-				inf->slice - inf->cputime,
-				now);
-				*/
-
-			//curr = (inf->slice_new * slice_length);
-			//curr /= inf->period_new;
-
-			//inf->local_slice = curr;
-
-			//}
-		    }
-		}
-	    }
-
 	    //if(inf->status & SC_ARRIVED)
 	    //	list_move(LIST(inf->vcpu), runq);
 
@@ -1862,6 +3426,10 @@ static void update_queues(int cpu, s_time_t now, const struct scheduler *ops)
 		    //while(!lock)
 		    //   lock = pcpu_schedule_trylock(migrate_to_processor);
 
+		    TRACE_4D(TRC_RTVIRT_MIGRATE,
+			    inf->vcpu->domain->domain_id, inf->vcpu->vcpu_id,
+			    inf->vcpu->processor, migrate_to_processor);
+
 		    inf->vcpu->processor = migrate_to_processor;
 		    inf->status |= SC_MIGRATED;
 		    list_move_tail(LIST(inf->vcpu), MIGQ(inf->vcpu->processor));
@@ -1875,7 +3443,7 @@ static void update_queues(int cpu, s_time_t now, const struct scheduler *ops)
 
 		    if(CPU_INFO(inf->vcpu->processor)->new_gl_d == 0 || CPU_INFO(inf->vcpu->processor)->current_slice_expires == 0 ||
 				is_idle_vcpu(per_cpu(schedule_data, inf->vcpu->processor).curr) )
-			    cpu_raise_softirq(inf->vcpu->processor, SCHEDULE_SOFTIRQ);
+			    cpumask_set_cpu(inf->vcpu->processor, &kick);
 
 		}
 		else
@@ -1890,6 +3458,8 @@ static void update_queues(int cpu, s_time_t now, const struct scheduler *ops)
 	}
     }
 
+    cpumask_raise_softirq(&kick, SCHEDULE_SOFTIRQ);
+
 /*
     list_for_each_safe ( cur, tmp, migq )
     {
@@ -1980,20 +3550,36 @@ static void update_current(int cpu, s_time_t now, const struct scheduler *ops)
 }
 */
 
+/*
+ * The boundary is due once global_deadline has passed. While a bandwidth
+ * change is pending (SC_SHIFT) the CPUs get a little slack to finish their
+ * current slices before everything is repartitioned.
+ */
+static inline int sc_boundary_due(struct sc_priv_info *prv, s_time_t now)
+{
+    if(prv->status & SC_SHIFT)
+	return (prv->global_deadline + prv->shift_delay <= now);
+
+    return (prv->global_deadline <= now);
+}
+
 static void global_deadline_barrier(struct sc_barrier_t* b, int cpu_id, s_time_t now, const struct scheduler *ops)
 {
     struct sc_vcpu_info *runinf, *runinf2, *curinf, *previnf;
     struct list_head     *cur, *tmp;
     s_time_t  new_global_start_value, new_global_deadline;
+    s_time_t  slice_start, deadline;
     s_time_t  l_cputime;
     s_time_t  l_sched_start_abs;
     unsigned long flags;
-    struct shared_info *si;
+    struct xen_rtvirt_channel *ch;
+    s_time_t  hint;
     //u64 start, end;
     //int cpu_count, i;
-    int i;
+    int i, shift;
+    unsigned int nr_placed = 0;
+    unsigned long epoch;
     struct sc_priv_info *prv = SC_PRIV(ops);
-    unsigned int nr_cpus = cpumask_last(&cpu_online_map) + 1;
 
     DPRINTK4("------ CPU: %d - %s - %d ------\n",
 	    cpu_id,
@@ -2008,29 +3594,51 @@ static void global_deadline_barrier(struct sc_barrier_t* b, int cpu_id, s_time_t
     //if(sc_debugging == 1 && smp_processor_id() < 2)
 //	printk("-- CPU: %d - DEBUG1 Time: %ld ---\n", smp_processor_id(), NOW());
 
-    new_global_start_value = global_deadline;
-    new_global_deadline = global_deadline;
+    // The epoch brackets the boundary like a seqlock: what is read here is
+    // one boundary only if the epoch was even before and has not moved
+    // since. Otherwise somebody else is at it: have them kick this CPU
+    // when done.
+    epoch = read_atomic(&b->epoch);
+    smp_rmb();
 
-    if(cpu_id == 0)
+    slice_start = prv->global_slice_start;
+    deadline = prv->global_deadline;
+
+    smp_rmb();
+    if((epoch & 1) || read_atomic(&b->epoch) != epoch)
     {
-	// If the one you got is not the current global_deadline
-	// then it was already updated. Go ahead and do calculations.
+	cpumask_set_cpu(cpu_id, &prv->kick);
+	return;
+    }
 
-	if(CPU_INFO(cpu_id)->new_gl_d != global_deadline)
-	{
-	    goto do_calculations;
-	}
+    new_global_start_value = deadline;
+    new_global_deadline = deadline;
+
+    if(CPU_INFO(cpu_id)->new_gl_d == deadline)
+    {
+	// Whichever CPU reaches the boundary first wins the epoch and
+	// computes the next global deadline. Everybody else returns right
+	// away and picks the result up once the epoch is even again.
+	if(!sc_boundary_due(prv, now))
+	    return;
 
+	// The epoch only goes odd once the lock is held, so the others never
+	// wait on a boundary that is itself waiting for the lock. It only
+	// changes under the lock: if it moved, the boundary got published
+	// while this CPU waited.
 	spin_lock_irqsave(&prv->lock, flags);
-	prv->status |= SC_CPU0_BUSY;
+	if(cmpxchg(&b->epoch, epoch, epoch + 1) != epoch)
+	{
+	    slice_start = prv->global_slice_start;
+	    deadline = prv->global_deadline;
+	    spin_unlock_irqrestore(&prv->lock, flags);
+	    goto published;
+	}
 
-	if( !list_empty(&deadline_queue) )
+	if( heapMin(&prv->deadline_heap) != NULL )
 	{
 check_runinf_again:
-	    runinf = list_entry(deadline_queue.next, struct sc_vcpu_info, d_list);
-	    //runinf = MIN_HEAP[0].data;
-
-	    si = (struct shared_info *) runinf->vcpu->domain->shared_info;
+	    runinf = heapMin(&prv->deadline_heap);
 
 /*	    if(runinf->status & SC_RUNNING)
 	    {
@@ -2102,39 +3710,14 @@ check_runinf_again:
 	    // task can start runnint at any time, then we won't be able to know it arrived until
 	    // we get to the old deadline of the VCPU.
 	    // IDEA: I don't think the above should cause any deadline misses. But I'll verify.
-	    if(si->extra_arg1[runinf->vcpu->vcpu_id] > 0)
-	    {
-		/*
-		if(si->extra_arg1[runinf->vcpu->vcpu_id] == 1)
-		{
-		    if(!(runinf->status & SC_SPORADIC))
-		    {
-			//runinf->status  |= SC_SPORADIC;
-			runinf->status  |= SC_ARRIVED;
-			//JC: FIXME This is not efficient!!!
-			list_move_tail(&runinf->sc_list, &sc_list_head);
-			prv->status |= SC_SHIFT;
-		    }
-		}
-		else if(runinf->status & SC_SPORADIC)
-		{
-		    runinf->status &= ~SC_SPORADIC;
-		    //runinf->status &= ~SC_ARRIVED;
-
-		    list_move(&runinf->sc_list, &sc_list_head);
-		    prv->status |= SC_SHIFT;
-		}
-		*/
+	    ch = sc_channel(runinf->vcpu);
+	    hint = (ch != NULL ? sc_channel_hint(ch, now) : 0);
 
+	    if(hint)
+	    {
+		// The guest's RT scheduler knows its next deadline best
 		runinf->status &= ~SC_UPDATE_DEADL;
-
-		//printk("-------- DomU deadl: %lu - RTA deadl: %lu ---------\n", runinf->deadl_abs, si->extra_arg3[runinf->vcpu->vcpu_id]);
-		runinf->deadl_abs = si->extra_arg3[runinf->vcpu->vcpu_id];
-		si->extra_arg4[runinf->vcpu->vcpu_id] = runinf->deadl_abs;
-		si->extra_arg3[runinf->vcpu->vcpu_id] = 0;
-
-		si->extra_arg1[runinf->vcpu->vcpu_id] = 0;
-		si->extra_arg2[runinf->vcpu->vcpu_id] = 0;
+		runinf->deadl_abs = hint;
 	    }
 	    else if(runinf->status & SC_UPDATE_DEADL)
 	    {
@@ -2149,41 +3732,6 @@ check_runinf_again:
 		// the queue so that it is resorted.
 
 		runinf->deadl_abs += runinf->period;
-		si->extra_arg4[runinf->vcpu->vcpu_id] = runinf->deadl_abs;
-
-		if(si->extra_arg5[runinf->vcpu->vcpu_id] > 0) // Is there an RTA running?
-		{
-		    if(si->extra_arg3[runinf->vcpu->vcpu_id])
-		    {
-			/*
-			 * printk("-------- DBG - DomU deadl: %lu - RTA deadl: %lu  - Next deadl: %lu - Now: %lu ---------\n",
-			 runinf->deadl_abs,
-			 si->extra_arg3,
-			 si->extra_arg5,
-			 now);
-			 printk("-------- DBG - Got from DomU %d.%d - %ld ---\n",
-			 runinf->vcpu->domain->domain_id,
-			 runinf->vcpu->vcpu_id,
-			 si->extra_arg3[runinf->vcpu->vcpu_id] - now);
-			 */
-
-			runinf->deadl_abs = si->extra_arg3[runinf->vcpu->vcpu_id];
-			si->extra_arg4[runinf->vcpu->vcpu_id] = runinf->deadl_abs;
-			si->extra_arg3[runinf->vcpu->vcpu_id] = 0;
-		    }
-		    else
-		    {
-			//if(previnf != runinf)
-			//    printk("-------- DBG - Got nothing from DomU %d.%d  ---\n",
-			//	    runinf->vcpu->domain->domain_id,
-			//	    runinf->vcpu->vcpu_id);
-			si->extra_arg3[runinf->vcpu->vcpu_id] = 0;
-		    }
-		}
-		//else
-		//{
-		//    runinf->status &= ~SC_ARRIVED;
-		//}
 	    }
 
 
@@ -2194,38 +3742,26 @@ check_runinf_again:
 			runinf->vcpu->domain->domain_id,
 			runinf->vcpu->vcpu_id,
 			now - runinf->deadl_abs);
+		TRACE_3D(TRC_RTVIRT_SKIP,
+			runinf->vcpu->domain->domain_id, runinf->vcpu->vcpu_id,
+			(uint32_t)(now - runinf->deadl_abs));
 		//BUG_ON(1);
 
 		if(runinf->deadl_abs == 0)
 		    runinf->deadl_abs = now;
 		else
 		    runinf->deadl_abs += runinf->period;
-
-		si->extra_arg4[runinf->vcpu->vcpu_id] = runinf->deadl_abs;
-		si->extra_arg3[runinf->vcpu->vcpu_id] = 0;
 	    }
 
-	    if(task_on_deadline_queue(runinf->vcpu))
-		list_del_init(D_LIST(runinf->vcpu));
-
-	    list_insert_sort(&deadline_queue, D_LIST(runinf->vcpu), runq_comp);
-	    runinf   = list_entry(deadline_queue.next, struct sc_vcpu_info, d_list);
+	    if(ch != NULL)
+		write_atomic(&ch->deadline, runinf->deadl_abs);
 
-	    //updateMin(runinf);
-	    //runinf   = MIN_HEAP[0].data;
+	    heapUpdate(&prv->deadline_heap, runinf);
+	    runinf   = heapMin(&prv->deadline_heap);
 
 	    if(runinf->status & SC_UPDATE_DEADL)
 	    {
-		if(task_on_deadline_queue(runinf->vcpu))
-		    list_del_init(D_LIST(runinf->vcpu));
-
 		runinf->status &= ~SC_UPDATE_DEADL;
-
-		list_insert_sort(&deadline_queue, D_LIST(runinf->vcpu), runq_comp);
-		runinf   = list_entry(deadline_queue.next, struct sc_vcpu_info, d_list);
-
-		//updateMin(runinf);
-		//runinf   = MIN_HEAP[0].data;
 	    }
 
 	    previnf = runinf;
@@ -2244,33 +3780,32 @@ check_runinf_again:
 	       }
 	    */
 
-	    global_slice_start = new_global_start_value;
+	    prv->global_slice_start = new_global_start_value;
 
-	    if( (runinf->deadl_abs - now) < 250000)
+	    if( (runinf->deadl_abs - now) < prv->min_global_slice)
 	    {
 		//DPRINTK("*** BAD3 ***: Global slice might be too small: %ld ***\n", runinf->deadl_abs - global_slice_start);
 
-		runinf2  = list_entry(deadline_queue.next->next, struct sc_vcpu_info, d_list);
-		//runinf2  = MIN_HEAP[0].data;
+		runinf2  = heapSecond(&prv->deadline_heap);
 
-		if((runinf2->deadl_abs - now) < 250000)
+		if(runinf2 != NULL && (runinf2->deadl_abs - now) < prv->min_global_slice)
 		    goto check_runinf_again;
 		else
-		    new_global_deadline = now + 250000;
+		    new_global_deadline = now + prv->min_global_slice;
 	    }
 	    else
 		new_global_deadline = runinf->deadl_abs;
 
 	    //reverse_order_next = reverse_order_next * -1;
-	    reverse_order_next = 1;
+	    prv->reverse_order_next = 1;
 
 
 /*
 	       printk("-A.1- CPU: %d - now: %ld - old: %ld - new global_deadline: %ld - ID: %6d.%d - local_deadl: %ld - %s ------\n",
 	       cpu_id,
 	       now,
-	       global_slice_start,
-	       global_deadline,
+	       prv->global_slice_start,
+	       prv->global_deadline,
 	       runinf->vcpu->domain->domain_id,
 	       runinf->vcpu->vcpu_id,
 	       runinf->local_deadl,
@@ -2281,70 +3816,111 @@ check_runinf_again:
 	    printk("-- BAD -- A.2- Deadline queue is empty ---\n");
 	    //BUG_ON(1);
 //	    new_global_deadline = now;
-	    global_slice_start = global_deadline;
+	    prv->global_slice_start = prv->global_deadline;
 	    new_global_deadline += 1000000;
 	}
 
 	while(new_global_deadline <= now) {
 	    printk("-- BAD -- CPU: %d - Oops, global_deadline is very behind, by: %ld --\n", cpu_id, new_global_deadline - now);
 	    //BUG_ON(1);
-	    global_slice_start = global_deadline;
+	    prv->global_slice_start = prv->global_deadline;
 	    new_global_deadline += 1000000;
 	}
 
-	if(prv->status & SC_SHIFT)
-	{
-	    printk("-- Reseting CPUs BWs - DOM0_CPU_COUNT: %d - Online CPUS: %d - reverse: %d ---\n", dom0_cpu_count, nr_cpus, reverse_order_next);
-	    for(i = dom0_cpu_count; i < nr_cpus; i++)
-	    {
-		HSLICE(i) = 0;
-		HPERIOD(i) = 100000;
-	    }
-	}
+	// The plan tasklet had the whole slice to build the new partition.
+	// If something changed too late for it, the repartition waits for
+	// the next boundary: the change rescheduled the tasklet.
+	shift = (prv->status & SC_SHIFT) && prv->shadow->version == prv->plan_version;
+	if(shift)
+	    sc_plan_publish(prv);
 
-	for(i = dom0_cpu_count; i < nr_cpus; i++)
+	for(i = prv->dom0_cpu_count; i < prv->plan->nr_cpus; i++)
 	{
-	    CPU_INFO(i)->used_slice = 0;
-	    CPU_INFO(i)->used_period = 100000;
+	    CPU_INFO(prv->plan->fill[i])->used_slice = 0;
+	    CPU_INFO(prv->plan->fill[i])->used_period = 100000;
 	}
 
-	list_for_each_safe ( cur, tmp, &sc_list_head )
+	list_for_each_safe ( cur, tmp, &prv->sc_list_head )
 	{
 	    curinf = list_entry(cur, struct sc_vcpu_info, sc_list);
 
-	    if(prv->status & SC_SHIFT)
+	    if(shift)
 	    {
-		curinf->period_new = curinf->period_temp;
-		curinf->slice_new  = curinf->slice_temp;
-
-		curinf->slice_new = (100000 * curinf->slice_new) / curinf->period_new;
+		curinf->slice_new = curinf->next_bw;
 		curinf->period_new = 100000;
+		sc_update_shares(curinf);
 
 		curinf->period = curinf->period_temp * 1000;
 		curinf->slice = curinf->slice_temp * 1000;
 
-		dp_wrap_assign_pcpu(curinf->vcpu, ops);
+		prv->plan_moved += sc_assign_moved(&curinf->assign, &curinf->next_assign);
+		nr_placed += curinf->next_assign.placed;
+		dp_wrap_apply(prv, curinf->vcpu, &curinf->next_assign);
 	    }
 	    curinf->status &= ~SC_WOKEN;
-	    set_cpu_bw_reservation(curinf->vcpu);
+	    if(curinf->assign.placed)
+		set_cpu_bw_reservation(prv, curinf->vcpu);
 	}
 
 
 	new_global_start_value = NOW();
-	global_slice_start = new_global_start_value;
-
-	global_deadline = new_global_deadline;
-	prv->status &= ~SC_SHIFT;
-	prv->status &= ~SC_CPU0_BUSY;
-	spin_unlock_irqrestore(&prv->lock, flags);
+	prv->global_slice_start = new_global_start_value;
+
+	// How late the boundary got published; a pending repartition makes
+	// it late on purpose
+	if(prv->calibrating && !(prv->status & SC_SHIFT))
+	    sc_cost_sample(&prv->barrier_cost, new_global_start_value - prv->global_deadline);
+
+	prv->global_deadline = new_global_deadline;
+
+	// The changes staged for this plan are in force from this boundary
+	if(shift)
+	    list_for_each_safe ( cur, tmp, &prv->notify_pending )
+		sc_notify_done(prv, list_entry(cur, struct sc_dom_info, pending_elem),
+			new_global_start_value);
+
+	TRACE_4D(TRC_RTVIRT_BOUNDARY,
+		(uint32_t)(prv->global_deadline - prv->global_slice_start),
+		(uint32_t)prv->global_deadline, (uint32_t)(prv->global_deadline >> 32),
+		shift);
+	if(shift)
+	{
+	    TRACE_2D(TRC_RTVIRT_REPLAN, prv->plan_moved, nr_placed);
+	    prv->status &= ~SC_SHIFT;
+	}
 
-	for(i = dom0_cpu_count; i <= last_assigned_pcpu; i++)
+	// Switching got dearer or cheaper than the plan in use makes up for:
+	// repartition with the new overhead at the next global boundary. One
+	// still pending is either built with it, or this runs again once that
+	// one is published.
+	if(!(prv->status & SC_SHIFT) && sc_plan_overhead(prv) != prv->plan->overhead)
 	{
-	    //printk("--- JC: Calling cpu_raise_softirq ---\n");
-//	    if(is_idle_vcpu(per_cpu(schedule_data, i).curr))
-		cpu_raise_softirq(i, SCHEDULE_SOFTIRQ);
+	    prv->status |= SC_SHIFT;
+	    sc_plan_invalidate(prv);
 	}
 
+	if(prv->calibrating && !--prv->calibrating)
+	    sc_calibrate(prv);
+
+	// Only the CPUs waiting for this boundary, those it moved VCPUs to and
+	// those that never took one need an IPI; the others roll over on the
+	// timer they armed for it.
+	for_each_cpu ( i, &prv->cpumask )
+	    if(i >= prv->dom0_cpu_count && i <= prv->last_assigned_pcpu &&
+		    CPU_INFO(i)->new_gl_d == 0)
+		cpumask_set_cpu(i, &prv->kick);
+
+	slice_start = prv->global_slice_start;
+	deadline = prv->global_deadline;
+
+	// Publish: global_deadline and global_slice_start must be visible
+	// before the epoch goes even.
+	smp_wmb();
+	write_atomic(&b->epoch, epoch + 2);
+	spin_unlock_irqrestore(&prv->lock, flags);
+
+	sc_kick(prv);
+
 	//printk("--- START CALC --- Global Slice %ld ---\n", global_deadline - global_slice_start);
 	//atomic_dec(&b->updating_global_deadline);
     }
@@ -2365,25 +3941,87 @@ check_runinf_again:
 	    cpu_id,
 	    __func__);
 */
-	if(CPU_INFO(cpu_id)->new_gl_d == global_deadline)
-	    return;
     }
 
+ published:
+
     //if(sc_debugging == 1 && smp_processor_id() < 2)
 	//printk("-- CPU: %d - DEBUG2 Time: %ld ---\n", smp_processor_id(), NOW());
 
-do_calculations:
-
     //if(cpu_id != 0)
-	calculate_new_local_deadlines(cpu_id, now, ops);
+	calculate_new_local_deadlines(cpu_id, now, slice_start, deadline, ops);
     //update_queues(cpu_id, now, ops);
-    CPU_INFO(cpu_id)->new_gl_d = global_deadline;
+
+    // Should a newer boundary have been published meanwhile, this CPU
+    // still lays that one out the next time it gets here
+    CPU_INFO(cpu_id)->new_gl_d = deadline;
+}
+
+// Whether the CPU computing a boundary sends cpu an IPI if it never took one
+static inline int sc_boundary_kicks(struct sc_priv_info *prv, int cpu)
+{
+    return (cpu >= prv->dom0_cpu_count && cpu <= prv->last_assigned_pcpu);
+}
+
+/*
+ * How long cpu can stay idle: one timer, for when its boundary is due.
+ * Where another CPU is bound to send it an IPI first, because it is
+ * computing that boundary or because nothing has been placed here yet and
+ * dp_wrap_apply() will, it arms none at all. A boundary this CPU missed
+ * the IPI for is taken after the shortest slice.
+ */
+static s_time_t sc_idle_time(struct sc_priv_info *prv, int cpu, s_time_t now)
+{
+    s_time_t due = CPU_INFO(cpu)->new_gl_d;
+
+    if(due == 0)
+	return (sc_boundary_kicks(prv, cpu) ? SC_NO_TIMER : prv->extra_quantum);
+
+    if(due <= now)
+    {
+	if(sc_boundary_busy(prv))
+	{
+	    if(cpumask_test_cpu(cpu, &prv->kick))
+		return SC_NO_TIMER;
+	}
+	else if(prv->global_deadline != due)
+	{
+	    // Published and kicked before this CPU set its bit: take it now
+	    return 0;
+	}
+
+	// A pending repartition holds the boundary back, see sc_boundary_due()
+	due = prv->global_deadline;
+	if(prv->status & SC_SHIFT)
+	    due += prv->shift_delay;
+    }
+
+    return due - now;
+}
+
+/*
+ * The slot of cpu's table that has not ended by now, if any. The cursor
+ * only moves forward, so a whole global slice costs one pass over the table.
+ */
+static struct sc_slot *sc_slot_current(int cpu, s_time_t now)
+{
+    struct sc_cpu_info *spc = CPU_INFO(cpu);
+    struct sc_slot *slot;
+
+    while(spc->slot_next < spc->nr_slots)
+    {
+	slot = &spc->slots[spc->slot_next];
+	if(spc->slot_start + slot->offset + slot->length > now)
+	    return slot;
+	spc->slot_next++;
+    }
+
+    return NULL;
 }
 
 static struct task_slice sc_do_schedule(
 	const struct scheduler *ops, s_time_t now, bool_t tasklet_work_scheduled)
 {
-    int array_index, i, cpu_i;
     //int array_index, cpu_i;
     int                   cpu      = smp_processor_id();
     struct list_head     *runq     = RUNQ(cpu);
@@ -2391,7 +4029,10 @@ static struct task_slice sc_do_schedule(
     struct list_head     *migq     = MIGQ(cpu);
     struct sc_vcpu_info *inf     = EDOM_INFO(current);
     struct sc_vcpu_info *runinf;
+    struct sc_slot *slot;
     struct task_slice      ret;
+    struct sc_trace_rec *trc;
+    struct sc_trace_ring *ring;
     s_time_t              new_now;
     //struct shared_info *si;
     struct sc_priv_info *prv = SC_PRIV(ops);
@@ -2417,8 +4058,8 @@ static struct task_slice sc_do_schedule(
     {
 	runinf   = list_entry(migq->next,struct sc_vcpu_info,list);
 
-	//if(CPU_INFO(cpu)->new_gl_d > now  && !(prv->status & SC_CPU0_BUSY) && cpu == runinf->vcpu->processor)
-	if(!(prv->status & SC_CPU0_BUSY) && cpu == runinf->vcpu->processor)
+	//if(CPU_INFO(cpu)->new_gl_d > now  && !sc_boundary_busy(prv) && cpu == runinf->vcpu->processor)
+	if(!sc_boundary_busy(prv) && cpu == runinf->vcpu->processor)
 	{
 	    runinf->local_cputime = get_local_slice(runinf);
 	    //runinf->local_cputime = (CPU_INFO(cpu)->new_gl_d - now);
@@ -2431,8 +4072,14 @@ static struct task_slice sc_do_schedule(
 	}
     }
 
-    if( !is_idle_vcpu(current) && !(prv->status & SC_CPU0_BUSY) && inf->vcpu->processor == cpu)
+    if( !is_idle_vcpu(current) && !sc_boundary_busy(prv) && inf->vcpu->processor == cpu)
     {
+	if(inf->local_cputime > 0 && inf->local_cputime <= now - inf->sched_start_abs)
+	    TRACE_4D(TRC_RTVIRT_EXHAUST,
+		    inf->vcpu->domain->domain_id, inf->vcpu->vcpu_id,
+		    (uint32_t)(now - inf->sched_start_abs - inf->local_cputime),
+		    (uint32_t)get_local_slice(inf));
+
 	inf->local_cputime -= now - inf->sched_start_abs;
 	inf->cputime += now - inf->sched_start_abs;
 	inf->status |= SC_ASLEEP;
@@ -2464,26 +4111,10 @@ static struct task_slice sc_do_schedule(
 
 //choose_next_task:
 
-    if(cpu == 0)
-    {
-	if(prv->status & SC_SHIFT)
-	{
-	    if(CPU_INFO(cpu)->new_gl_d + 15000 <= now)
-		global_deadline_barrier(&prv->cpu_barrier, cpu, now, ops);
-	}
-	else
-	{
-	    if(CPU_INFO(cpu)->new_gl_d  == 0)
-		global_deadline_barrier(&prv->cpu_barrier, cpu, now, ops);
-	    else if(CPU_INFO(cpu)->new_gl_d <= now)
-		global_deadline_barrier(&prv->cpu_barrier, cpu, now, ops);
-	}
-    }
-    else
-    {
-	if(CPU_INFO(cpu)->new_gl_d <= now)
-	    global_deadline_barrier(&prv->cpu_barrier, cpu, now, ops);
-    }
+    // Any CPU that reaches its boundary may be the one to compute the next
+    // one; see global_deadline_barrier().
+    if(CPU_INFO(cpu)->new_gl_d <= now)
+	global_deadline_barrier(&prv->cpu_barrier, cpu, now, ops);
 
     new_now = NOW();
     if ( tasklet_work_scheduled ||
@@ -2492,18 +4123,32 @@ static struct task_slice sc_do_schedule(
     {
 	ret.task = IDLETASK(cpu);
 	//ret.time = SECONDS(1);
-	ret.time = EXTRA_QUANTUM;
+	ret.time = prv->extra_quantum;
     }
     //else if (!list_empty(runq))
-    else if (!list_empty(runq) && (CPU_INFO(cpu)->new_gl_d >= (now+5000) || cpu == 0) && !(prv->status & SC_CPU0_BUSY))
+    else if (!list_empty(runq) && CPU_INFO(cpu)->new_gl_d >= now + sc_min_slice(cpu) && !sc_boundary_busy(prv))
     {
 	runinf   = list_entry(runq->next,struct sc_vcpu_info,list);
+	slot = sc_slot_current(cpu, now);
 	//last   = list_entry(sc_list_head.prev,struct sc_vcpu_info, sc_list);
 
 //	if( ((runinf->vcpu->is_running && runinf == inf) || (!runinf->vcpu->is_running)) &&
 //	(sc_active(runinf, now) && vcpu_runnable(runinf->vcpu)) )
 
-	if(sc_active(runinf, now) && vcpu_runnable(runinf->vcpu) && (!(runinf->vcpu->is_running) || runinf == inf))
+	// A periodic VCPU gets its slot, or the CPU idles through it. runq
+	// only decides when something got ahead of the layout: a sporadic
+	// VCPU that arrived, a split one that migrated here, or one whose
+	// slot went past SC_SLOTS.
+	if(slot != NULL && slot->inf == runinf && !(runinf->status & SC_SPORADIC))
+	{
+	    if(sc_active(runinf, now) && vcpu_runnable(runinf->vcpu) && (!(runinf->vcpu->is_running) || runinf == inf))
+		ret.task = runinf->vcpu;
+	    else
+		ret.task = IDLETASK(cpu);
+
+	    ret.time = CPU_INFO(cpu)->slot_start + slot->offset + slot->length - now;
+	}
+	else if(sc_active(runinf, now) && vcpu_runnable(runinf->vcpu) && (!(runinf->vcpu->is_running) || runinf == inf))
 	{
 	    ret.task = runinf->vcpu;
 
@@ -2527,38 +4172,28 @@ static struct task_slice sc_do_schedule(
 	    /*
 	    if(runinf->status & SC_MIGRATED)
 		ret.time = CPU_INFO(cpu)->new_gl_d - now;
-	    else if(!(runinf->status & SC_SPLIT) && reverse_order_next > 0 && runinf == last)
+	    else if(!(runinf->status & SC_SPLIT) && prv->reverse_order_next > 0 && runinf == last)
 		ret.time = CPU_INFO(cpu)->new_gl_d - now;
 	    else
 	*/	//ret.time = (runinf->local_cputime + now <= CPU_INFO(cpu)->new_gl_d ? runinf->local_cputime : CPU_INFO(cpu)->new_gl_d - now);
-
-	    if(cpu == 0)
-		ret.time = (global_deadline - now);
 	}
 	else
 	{
+	    // A sporadic VCPU that has not arrived is woken by sc_wake()
 	    if(runinf->status & SC_SPORADIC)
-		ret.time = (MILLISECS(100) + now <= CPU_INFO(cpu)->new_gl_d ? MILLISECS(100) : CPU_INFO(cpu)->new_gl_d - now);
+		ret.time = sc_idle_time(prv, cpu, now);
 	    else
 		ret.time = get_local_deadl(runinf) - now;
 
+	    // If it is only still running on the CPU it left, sc_context_saved()
+	    // there kicks this one as soon as its state is saved.
 	    ret.task = IDLETASK(cpu);
-
-	    if(runinf->vcpu->is_running)
-	    {
-		//printk("--- %d.%d is still running --\n", runinf->vcpu->domain->domain_id, runinf->vcpu->vcpu_id);
-		ret.time = MICROSECS(4);
-	    }
 	}
     }
     else
     {
 	ret.task = IDLETASK(cpu);
-
-	if(CPU_INFO(cpu)->new_gl_d != 0)
-	    ret.time = (MILLISECS(100) + now <= CPU_INFO(cpu)->new_gl_d ? MILLISECS(100) : CPU_INFO(cpu)->new_gl_d - now);
-	else
-	    ret.time = MICROSECS(4);
+	ret.time = sc_idle_time(prv, cpu, now);
 
 	//ret.time = MILLISECS(1);
 	//ret.time = CPU_INFO(cpu)->new_gl_d - now;
@@ -2568,7 +4203,7 @@ static struct task_slice sc_do_schedule(
      * TODO: Do something USEFUL when this happens and find out, why it
      * still can happen!!!
      */
-    if ( ret.time < 5000)
+    if ( ret.time != SC_NO_TIMER && ret.time < sc_min_slice(cpu) )
     {
 	/*
 	printk("--- CPU: %d - Ouch! We are seriously BEHIND schedule! %"PRIi64"\n",
@@ -2579,7 +4214,7 @@ static struct task_slice sc_do_schedule(
 	    ret.task->domain->domain_id,
 	    ret.task->vcpu_id,
 	    ret.time,
-	    global_deadline,
+	    prv->global_deadline,
 	    __func__);
 	    */
 	//ret.time = (MICROSECS(5) + new_now <= CPU_INFO(cpu)->new_gl_d ? MICROSECS(5) : CPU_INFO(cpu)->new_gl_d - new_now);
@@ -2588,7 +4223,7 @@ static struct task_slice sc_do_schedule(
 	//else
 
 	// FIXME: Note cpu 0 should never get here.
-	    ret.time = MICROSECS(5);
+	    ret.time = sc_min_slice(cpu);
     }
 
     if(EDOM_INFO(ret.task)->status & SC_MIGRATED)
@@ -2603,88 +4238,34 @@ static struct task_slice sc_do_schedule(
 
     if(sc_debugging == 1)
     {
-	if(CPU_INFO(cpu)->d_array_index < DEBUG_LINES)
-	{
-	    array_index = CPU_INFO(cpu)->d_array_index;
-	    array_index--;
-
-	    if(ret.task->domain->domain_id != 32767 || (array_index > 0 && CPU_INFO(cpu)->d_array[array_index].domid != ret.task->domain->domain_id))
-	    {
-		array_index = CPU_INFO(cpu)->d_array_index;
-		CPU_INFO(cpu)->d_array[array_index].domid = ret.task->domain->domain_id;
-		CPU_INFO(cpu)->d_array[array_index].vcpuid = ret.task->vcpu_id;
-		CPU_INFO(cpu)->d_array[array_index].now_time = new_now - now;
-		CPU_INFO(cpu)->d_array[array_index].ret_time = ret.time;
-		CPU_INFO(cpu)->d_array[array_index].slice_time = EDOM_INFO(ret.task)->local_cputime;
-		CPU_INFO(cpu)->d_array[array_index].alloc = now - inf->sched_start_abs;
-		CPU_INFO(cpu)->d_array_index++;
-
-/*
-		printk("-DEBUG: %d %ld %7d. %ld %ld %ld -\n",
-			cpu,
-			new_now - now,
-			ret.task->domain->domain_id,
-			ret.time,
-			EDOM_INFO(ret.task)->local_cputime,
-			now - inf->sched_start_abs);
- */
-	    }
-	}
-	else
-	{
-	    sc_debugging = 3;
-	}
-    }
-    else if(sc_debugging < 1 && cpu == 0)
-    {
-	if( (sc_debugging*-1) <= last_assigned_pcpu && (sc_debugging*-1) < 9)
+	// Only the first of a run of idle picks is worth a record
+	ring = prv->trace[cpu];
+	if(ring != NULL &&
+		(ret.task->domain->domain_id != DOMID_IDLE || ring->last_domid != DOMID_IDLE) &&
+		(trc = sc_trace_get(prv, cpu)) != NULL)
 	{
-	    cpu_i = (sc_debugging*-1);
-
-	    for(i = CPU_INFO(cpu_i)->print_index;
-		    i < CPU_INFO(cpu_i)->print_index + 250 && i < DEBUG_LINES; i++)
-	    {
-		printk("- %d %ld %7d.%d %ld %ld %ld -\n",
-			cpu_i,
-			CPU_INFO(cpu_i)->d_array[i].now_time,
-			CPU_INFO(cpu_i)->d_array[i].domid,
-			CPU_INFO(cpu_i)->d_array[i].vcpuid,
-			CPU_INFO(cpu_i)->d_array[i].ret_time,
-			CPU_INFO(cpu_i)->d_array[i].slice_time,
-			CPU_INFO(cpu_i)->d_array[i].alloc);
-
-		if(CPU_INFO(cpu_i)->d_array[i].alloc == 0)
-		{
-		    i = -1;
-		    break;
-		}
-
-		CPU_INFO(cpu_i)->d_array[i].now_time = 0;
-		CPU_INFO(cpu_i)->d_array[i].domid = 0;
-		CPU_INFO(cpu_i)->d_array[i].vcpuid = 0;
-		CPU_INFO(cpu_i)->d_array[i].ret_time = 0;
-		CPU_INFO(cpu_i)->d_array[i].slice_time = 0;
-		CPU_INFO(cpu_i)->d_array[i].alloc = 0;
-	    }
-
-	    if(i == -1 || i == DEBUG_LINES)
-	    {
-		CPU_INFO(cpu_i)->d_array_index = 0;
-		CPU_INFO(cpu_i)->print_index = 0;
-		sc_debugging--;
-	    }
-	    else
-		CPU_INFO(cpu_i)->print_index = i;
+	    trc->stamp = now;
+	    trc->event = SC_TRC_PICK;
+	    trc->domid = ret.task->domain->domain_id;
+	    trc->vcpuid = ret.task->vcpu_id;
+	    trc->ret_time = sc_trace_ns(ret.time);
+	    trc->cputime = sc_trace_ns(EDOM_INFO(ret.task)->local_cputime);
+	    trc->alloc = sc_trace_ns(now - inf->sched_start_abs);
+	    trc->cost = sc_trace_ns(new_now - now);
+	    sc_trace_put(prv, cpu);
+
+	    ring->last_domid = trc->domid;
 	}
-	else
-	    sc_debugging = 4;
     }
 
     EDOM_INFO(ret.task)->sched_start_abs = now;
     EDOM_INFO(ret.task)->status |= SC_RUNNING;
-    CHECK(ret.time > 0);
+    CHECK(ret.time > 0 || ret.time == SC_NO_TIMER);
     ASSERT(sc_runnable(ret.task));
-    CPU_INFO(cpu)->current_slice_expires = now + ret.time;
+    CPU_INFO(cpu)->current_slice_expires = (ret.time == SC_NO_TIMER ? 0 : now + ret.time);
+
+    if(prv->calibrating)
+	sc_cost_sample(&CPU_INFO(cpu)->sched_cost, NOW() - now);
 
     DPRINTK4("------ THIS CPU: %d - END -----\n",
 	    cpu);
@@ -2711,8 +4292,8 @@ static void sc_sleep(const struct scheduler *ops, struct vcpu *d)
     if(EDOM_INFO(d)->status & SC_SPORADIC)
 	list_move_tail(LIST(d), waitq);
 
-    if(unlikely(!__task_on_sclist(d)) && d->domain->domain_id != 0)
-	list_add_tail(&(EDOM_INFO(d)->sc_list), &sc_list_head);
+    if(unlikely(!__task_on_sclist(d)))
+	sc_list_join(ops, d);
 
     if ( per_cpu(schedule_data, d->processor).curr == d )
     {
@@ -2751,28 +4332,11 @@ static void sc_wake(const struct scheduler *ops, struct vcpu *d)
 
     spin_lock_irqsave(&prv->lock, flags);
 
-    if(prv->status & SC_CPU0_BUSY)
-    {
-	printk("--- DEBUGGING: calling sc_wake while CPU 0 is activated ---\n");
-
-	// JC HACK: FIXME: This is a rudimentary spinlock. Should be better implemented. We
-	// use a while instead of a return, to wait for CPU 0 to finish moving stuff around.
-	// If during this time it detects that the woken VCPU is runnable it will do what needs
-	// to be done (e.g. move it the corresponding runq, or mark it as split). If it did not
-	// detect that is was runnable we will take care of moving.
-	// TODO: Moving a split VCPU may happen a i little too late, and we might miss a deadline
-
-	//if(smp_processor_id() != 0)
-	   //while(prv->status & SC_CPU0_BUSY);
-
-	//return;
-    }
-
 //    spin_unlock_irqrestore(&prv->lock, flags);
 
 //    now = NOW();
     //slice_length = CPU_INFO(d->processor)->new_gl_d - now;
-    slice_length = global_deadline - now;
+    slice_length = prv->global_deadline - now;
 
     ASSERT(!sc_runnable(d));
     inf->status &= ~SC_ASLEEP;
@@ -2790,11 +4354,10 @@ static void sc_wake(const struct scheduler *ops, struct vcpu *d)
 	//spin_lock_irqsave(&prv->lock, flags);
 
 	// Done one time.
-	if(global_deadline == 0)
-	    global_deadline = now;
+	if(prv->global_deadline == 0)
+	    prv->global_deadline = now;
 
-	list_insert_sort(&deadline_queue, D_LIST(d), runq_comp);
-	//heapInsert(inf);
+	heapInsert(&prv->deadline_heap, inf);
 	//spin_unlock_irqrestore(&prv->lock, flags);
 
 	if(!__task_on_queue(d))
@@ -2803,8 +4366,8 @@ static void sc_wake(const struct scheduler *ops, struct vcpu *d)
 	    list_add_tail(LIST(d), INACTIVEQ(d->processor));
 	}
 
-	if(unlikely(!__task_on_sclist(d)) && d->domain->domain_id != 0)
-	    list_add_tail(&inf->sc_list, &sc_list_head);
+	if(unlikely(!__task_on_sclist(d)))
+	    sc_list_join(ops, d);
     }
     else
     {
@@ -2812,6 +4375,9 @@ static void sc_wake(const struct scheduler *ops, struct vcpu *d)
 	{
 	    si = (struct shared_info *) inf->vcpu->domain->shared_info;
 
+	    TRACE_3D(TRC_RTVIRT_ARRIVE, d->domain->domain_id, d->vcpu_id,
+		    (uint32_t)slice_length);
+
 	    if(inf->status & SC_UPDATE_DEADL)// || inf->status & SC_ARRIVED)
 	    {
 		// FIXME: I think we get here if the VM woke up and we recalculated its
@@ -2819,8 +4385,7 @@ static void sc_wake(const struct scheduler *ops, struct vcpu *d)
 
 		if(inf->status & SC_SPLIT)
 		{
-		    curr = (inf->slice_b * slice_length);
-		    curr /= inf->period_b;
+		    curr = sc_scale(inf->share_b, slice_length);
 
 		    inf->local_slice_second = curr;
 		    inf->local_cputime = inf->local_slice_second;
@@ -2828,16 +4393,14 @@ static void sc_wake(const struct scheduler *ops, struct vcpu *d)
 		    if(!(inf->status & SC_MIGRATED))
 			inf->status |= SC_MIGRATING;
 
-		    curr = (inf->slice_a * slice_length);
-		    curr /= inf->period_a;
+		    curr = sc_scale(inf->share_a, slice_length);
 
-		    inf->local_deadl = global_deadline;
+		    inf->local_deadl = prv->global_deadline;
 		    inf->local_slice = curr;
 		}
 		else
 		{
-		    curr = (inf->slice_new * slice_length);
-		    curr /= inf->period_new;
+		    curr = sc_scale(inf->share_new, slice_length);
 
 		    inf->local_slice = curr;
 		    inf->local_cputime = inf->local_slice;
@@ -2861,31 +4424,28 @@ static void sc_wake(const struct scheduler *ops, struct vcpu *d)
 	//	inf->deadl_abs = now + inf->period;
 		if(!(inf->status & SC_WOKEN))
 		{
-		    dynamic_reservation(inf->vcpu);
+		    dynamic_reservation(prv, inf->vcpu);
 
 		    inf->status |= SC_WOKEN;
 
 		    if(inf->status & SC_SPLIT)
 		    {
-			curr = (inf->slice_b * slice_length);
-			curr /= inf->period_b;
+			curr = sc_scale(inf->share_b, slice_length);
 
 			inf->local_slice_second = curr;
 			inf->local_cputime = inf->local_slice_second;
 
 			inf->status |= SC_MIGRATING;
 
-			curr = (inf->slice_a * slice_length);
-			curr /= inf->period_a;
+			curr = sc_scale(inf->share_a, slice_length);
 
-			inf->local_deadl = global_deadline;
+			inf->local_deadl = prv->global_deadline;
 			inf->local_slice = curr;
 		    }
 		    else
 		    {
 			// TODO: Recalculate the local subslice
-			curr = (inf->slice_new * slice_length);
-			curr /= inf->period_new;
+			curr = sc_scale(inf->share_new, slice_length);
 
 			inf->local_slice = curr;
 			inf->local_cputime = inf->local_slice;
@@ -2968,31 +4528,210 @@ static void sc_wake(const struct scheduler *ops, struct vcpu *d)
 /* Dumps all domains on the specified cpu */
 static void sc_dump_cpu_state(const struct scheduler *ops, int i)
 {
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    struct sc_cpu_info *spc = CPU_INFO(i);
+    struct sc_vcpu_info *inf;
+    struct sc_slot *slot;
+    int n;
+
     DPRINTK("------ CPU: %d - %s ------\n",
 	    smp_processor_id(),
 	    __func__);
 
     printk("now=%"PRIu64"\n",NOW());
+
+    printk("slice: %ld - %ld\n", prv->global_slice_start, prv->global_deadline);
+    list_for_each_entry ( inf, RUNQ(i), list )
+	printk("  %6d.%d - local deadline: %ld - local slice: %ld\n",
+		inf->vcpu->domain->domain_id,
+		inf->vcpu->vcpu_id,
+		get_local_deadl(inf),
+		inf->local_cputime);
+
+    printk("slots: %d - next: %d - start: %ld\n", spc->nr_slots, spc->slot_next, spc->slot_start);
+    for(n = 0; n < spc->nr_slots; n++)
+    {
+	slot = &spc->slots[n];
+	if(slot->inf == NULL)
+	    continue;
+	printk("  %3d: %6d.%d - offset: %ld - length: %ld\n",
+		n,
+		slot->inf->vcpu->domain->domain_id,
+		slot->inf->vcpu->vcpu_id,
+		slot->offset,
+		slot->length);
+    }
 }
 
 
 
 /* Set or fetch domain scheduling parameters */
+static inline int sc_bw_valid(s_time_t period, s_time_t slice)
+{
+    return (period != 0 &&
+	    period <= PERIOD_MAX &&
+	    period >= PERIOD_MIN &&
+	    slice <= period &&
+	    slice >= SLICE_MIN);
+}
+
+/*
+ * Give v a bandwidth of slice every period (ns), which sc_admit() has let
+ * in. The first time round (SC_DEFAULT) it takes effect right away, in the
+ * place its default bandwidth had; after that it is only staged in
+ * period_temp/slice_temp. Either way 1 is returned: the CPUs have to be
+ * repartitioned for it. Called with prv->lock held.
+ */
+static int sc_vcpu_set_bw(struct sc_priv_info *prv, struct vcpu *v, s_time_t period, s_time_t slice)
+{
+    struct sc_vcpu_info *inf = EDOM_INFO(v);
+
+    sc_admitted(prv, inf, sc_bw(v, period, slice), sc_rate(v, period));
+    sc_plan_dirty(prv, inf);
+
+    inf->weight = 0;
+    inf->extraweight = 0;
+
+    inf->period_temp = period / 1000;
+    inf->slice_temp  = slice  / 1000;
+
+    if(!(inf->status & SC_DEFAULT))
+	return 1;
+
+    inf->period_new = inf->period_temp;
+    inf->slice_new  = inf->slice_temp;
+
+    inf->slice_new = (100000 * inf->slice_new) / inf->period_new;
+    inf->period_new = 100000;
+    sc_update_shares(inf);
+
+    inf->period = period;
+    inf->slice = slice;
+    inf->status &= ~SC_DEFAULT;
+
+    // Its place was made for the default bandwidth
+    return 1;
+}
+
+/*
+ * XEN_DOMCTL_SCHEDOP_putvcpuinfo: set the bandwidth of several of p's VCPUs
+ * in one go, e.g. every VCPU of a guest as it boots. The whole array is
+ * checked and admitted before anything changes, then applied under one hold
+ * of the lock, so the host is repartitioned once for all of them instead of
+ * once per VCPU. Each entry's status comes back with 0, or with why the
+ * batch could not be applied on its account. When the sum does not fit,
+ * left says how much of it would have.
+ */
+static int sc_adjust_vcpus(const struct scheduler *ops, struct domain *p, struct xen_domctl_scheduler_op *op)
+{
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    xen_domctl_schedparam_vcpu_t *params;
+    struct vcpu *v;
+    unsigned int i, nr = op->u.v.nr_vcpus;
+    unsigned long flags;
+    s_time_t release = 0, request = 0, nr_after, rate_after;
+    uint8_t *seen;
+    int shift = 0, rc = 0;
+
+    if ( nr == 0 || nr > p->max_vcpus )
+	return -EINVAL;
+
+    params = xmalloc_array(xen_domctl_schedparam_vcpu_t, nr);
+    seen = xzalloc_array(uint8_t, p->max_vcpus);
+    if ( params == NULL || seen == NULL )
+    {
+	rc = -ENOMEM;
+	goto out_free;
+    }
+
+    if ( copy_from_guest(params, op->u.v.vcpus, nr) )
+    {
+	rc = -EFAULT;
+	goto out_free;
+    }
+
+    // Each VCPU at most once, so the admission test below adds up
+    for ( i = 0; i < nr; i++ )
+    {
+	params[i].status = 0;
+	if ( params[i].vcpuid >= p->max_vcpus ||
+		p->vcpu[params[i].vcpuid] == NULL )
+	    params[i].status = -ESRCH;
+	else if ( seen[params[i].vcpuid]++ ||
+		!sc_bw_valid(params[i].u.sc.period, params[i].u.sc.slice) )
+	    params[i].status = -EINVAL;
+
+	if ( params[i].status )
+	    rc = -EINVAL;
+    }
+
+    if ( rc )
+	goto out_status;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    nr_after = prv->nr_admitted;
+    rate_after = prv->rate_admitted;
+    for ( i = 0; i < nr; i++ )
+    {
+	v = p->vcpu[params[i].vcpuid];
+	release += EDOM_INFO(v)->bw;
+	request += sc_bw(v, params[i].u.sc.period, params[i].u.sc.slice);
+	nr_after += !!sc_rate(v, params[i].u.sc.period) - !!EDOM_INFO(v)->rate;
+	rate_after += sc_rate(v, params[i].u.sc.period) - EDOM_INFO(v)->rate;
+    }
+
+    rc = sc_admit(prv, release, request, nr_after, rate_after, &op->u.v.left);
+    if ( rc )
+    {
+	spin_unlock_irqrestore(&prv->lock, flags);
+
+	// It is the sum that does not fit, not any one entry
+	for ( i = 0; i < nr; i++ )
+	    params[i].status = rc;
+	goto out_status;
+    }
+
+    for ( i = 0; i < nr; i++ )
+	shift |= sc_vcpu_set_bw(prv, p->vcpu[params[i].vcpuid],
+		params[i].u.sc.period, params[i].u.sc.slice);
+
+    if ( shift )
+	tell_vcpus_to_find_new_pcpus(p->vcpu[params[0].vcpuid], &prv->cpu_barrier, ops);
+    sc_plan_invalidate(prv);
+    sc_notify_request(prv, p->sched_priv, shift);
+
+    spin_unlock_irqrestore(&prv->lock, flags);
+
+ out_status:
+    if ( copy_to_guest(op->u.v.vcpus, params, nr) && rc == 0 )
+	rc = -EFAULT;
+
+ out_free:
+    xfree(seen);
+    xfree(params);
+    return rc;
+}
+
 static int sc_adjust(const struct scheduler *ops, struct domain *p, struct xen_domctl_scheduler_op *op)
 {
     //spinlock_t *lock;
-    struct shared_info *si;
+    struct xen_rtvirt_channel *ch;
     struct sc_priv_info *prv = SC_PRIV(ops);
     unsigned long flags;
     s_time_t              now = NOW();
     struct vcpu *v;
-    int rc = 0;
+    int rc = 0, answered = 0, shift;
+
+    // The guests' batched hypercall, kept off the console
+    if ( op->cmd == XEN_DOMCTL_SCHEDOP_putvcpuinfo )
+	return sc_adjust_vcpus(ops, p, op);
 
     DPRINTK("------ CPU: %d - %s ------\n",
 	    smp_processor_id(),
 	    __func__);
 
-    printk("--- %s -- now: %llu - domain_id: %d - period: %ld - slice: %ld - vcpu_id: %d - weight: %d ---\n",
+    DPRINTK("--- %s -- now: %llu - domain_id: %d - period: %ld - slice: %ld - vcpu_id: %d - weight: %d ---\n",
 	    __func__,
 	    (long long unsigned int) now,
 	    p->domain_id,
@@ -3003,15 +4742,20 @@ static int sc_adjust(const struct scheduler *ops, struct domain *p, struct xen_d
 
     if((op->u.sc.period == 2*PERIOD_MAX))
     {
-	//Do nothing; don't print; don't collect
+	// Toggles tracing; the records are printed by sc_trace_tasklet()
 	if(sc_debugging == 4)
 	{
-	    sc_debugging = 1; //Start collecting
-	    printk("- Started collecting-\n");
+	    rc = sc_trace_start(ops, p);
+	    if(rc == 0)
+	    {
+		sc_debugging = 1; //Start collecting
+		printk("- Started collecting-\n");
+	    }
 	}
-	else if(sc_debugging == 1 || sc_debugging == 3)
+	else if(sc_debugging == 1)
 	{
-	    sc_debugging = 0; //Stop collecting and print
+	    sc_debugging = 4; //Stop collecting, print what is left
+	    tasklet_schedule_on_cpu(&prv->trace_tasklet, sc_tasklet_cpu(prv));
 	    printk("- Printing -\n");
 	}
 
@@ -3031,50 +4775,34 @@ static int sc_adjust(const struct scheduler *ops, struct domain *p, struct xen_d
 
     if ( op->cmd == XEN_DOMCTL_SCHEDOP_putinfo )
     {
-	si = (struct shared_info *) p->shared_info;
-
-	if(si->extra_arg2[0] == 3)
+	// A putinfo that comes with cputime queries only answers those
+	for_each_vcpu ( p, v )
 	{
-	    if(EDOM_INFO(p->vcpu[0])->status & SC_RUNNING)
-		si->extra_arg2[0] = EDOM_INFO(p->vcpu[0])->cputime + (now-EDOM_INFO(p->vcpu[0])->sched_start_abs);
-	    else
-		si->extra_arg2[0] = EDOM_INFO(p->vcpu[0])->cputime;
+	    ch = sc_channel(v);
+	    if(ch == NULL || read_atomic(&ch->query) != XEN_RTVIRT_QUERY_CPUTIME)
+		continue;
 
-	    goto out;
-	}
-	else if(si->extra_arg2[1] == 3)
-	{
-	    if(EDOM_INFO(p->vcpu[1])->status & SC_RUNNING)
-		si->extra_arg2[1] = EDOM_INFO(p->vcpu[1])->cputime + (now-EDOM_INFO(p->vcpu[1])->sched_start_abs);
+	    if(EDOM_INFO(v)->status & SC_RUNNING)
+		ch->cputime = EDOM_INFO(v)->cputime + (now-EDOM_INFO(v)->sched_start_abs);
 	    else
-		si->extra_arg2[1] = EDOM_INFO(p->vcpu[1])->cputime;
+		ch->cputime = EDOM_INFO(v)->cputime;
 
-	    goto out;
+	    smp_wmb();
+	    write_atomic(&ch->query, 0);
+	    answered = 1;
 	}
 
-	/* Check for sane parameters */
-	if ( !op->u.sc.period )
-	{
-	    printk("------ cpu: %d - %s - %d ------\n",
-		    smp_processor_id(),
-		    __func__,
-		    __LINE__);
-
-	    rc = -EINVAL;
+	if(answered)
 	    goto out;
-	}
 
-	if ( (op->u.sc.period > PERIOD_MAX) ||
-		(op->u.sc.period < PERIOD_MIN) ||
-		(op->u.sc.slice  > op->u.sc.period) ||
-		(op->u.sc.slice  < SLICE_MIN) )
+	/* Check for sane parameters */
+	if ( !sc_bw_valid(op->u.sc.period, op->u.sc.slice) )
 	{
 	    printk("------ cpu: %d - %s - %d ------\n",
 		    smp_processor_id(),
 		    __func__,
 		    __LINE__);
 
-
 	    rc = -EINVAL;
 	    goto out;
 	}
@@ -3095,34 +4823,18 @@ static int sc_adjust(const struct scheduler *ops, struct domain *p, struct xen_d
 		continue;
 	    }
 */
-	    EDOM_INFO(v)->weight = 0;
-	    EDOM_INFO(v)->extraweight = 0;
-
-	    EDOM_INFO(v)->period_temp = op->u.sc.period / 1000;
-	    EDOM_INFO(v)->slice_temp  = op->u.sc.slice  / 1000;
-/*
-	    EDOM_INFO(v)->period_new = EDOM_INFO(v)->period_temp;
-	    EDOM_INFO(v)->slice_new  = EDOM_INFO(v)->slice_temp;
-
-	    EDOM_INFO(v)->slice_new = (100000 * EDOM_INFO(v)->slice_new) / EDOM_INFO(v)->period_new;
-	    EDOM_INFO(v)->period_new = 100000;
-*/
-	    printk("-- Before dp-wrap --\n");
-	    if(EDOM_INFO(v)->status & SC_DEFAULT)
-	    {
-		EDOM_INFO(v)->period_new = EDOM_INFO(v)->period_temp;
-		EDOM_INFO(v)->slice_new  = EDOM_INFO(v)->slice_temp;
-
-		EDOM_INFO(v)->slice_new = (100000 * EDOM_INFO(v)->slice_new) / EDOM_INFO(v)->period_new;
-		EDOM_INFO(v)->period_new = 100000;
-
-		EDOM_INFO(v)->period = op->u.sc.period;
-		EDOM_INFO(v)->slice = op->u.sc.slice;
-		EDOM_INFO(v)->status &= ~SC_DEFAULT;
-	    }
-	    else
+	    rc = sc_admit(prv, EDOM_INFO(v)->bw, sc_bw(v, op->u.sc.period, op->u.sc.slice),
+		    prv->nr_admitted + !!sc_rate(v, op->u.sc.period) - !!EDOM_INFO(v)->rate,
+		    prv->rate_admitted + sc_rate(v, op->u.sc.period) - EDOM_INFO(v)->rate,
+		    &op->u.sc.left);
+	    if(rc)
+		break;
+
+	    shift = sc_vcpu_set_bw(prv, v, op->u.sc.period, op->u.sc.slice);
+	    if(shift)
 		tell_vcpus_to_find_new_pcpus(v, &prv->cpu_barrier, ops);
-	    printk("-- After dp-wrap --\n");
+	    sc_plan_invalidate(prv);
+	    sc_notify_request(prv, p->sched_priv, shift);
 
 	    //--> vcpu_schedule_unlock(lock, v);
 
@@ -3146,34 +4858,97 @@ static int sc_adjust(const struct scheduler *ops, struct domain *p, struct xen_d
 out:
     spin_unlock_irqrestore(&prv->lock, flags);
 
-    printk("--- rc value: %d ---\n", rc);
+    DPRINTK("--- rc value: %d ---\n", rc);
+    return rc;
+}
+
+/*
+ * Read or set the timing constants. A constant left 0 keeps its value, and
+ * calibrate starts a calibration run, whose results replace all of them
+ * once it is done; getinfo returns in calibrate how many boundaries that
+ * run still samples. A new full_slack applies from the next plan on.
+ */
+static int sc_adjust_global(const struct scheduler *ops, struct xen_sysctl_scheduler_op *op)
+{
+    struct xen_sysctl_sched_sc *params = &op->u.sc;
+    struct sc_priv_info *prv = SC_PRIV(ops);
+    s_time_t min_global_slice, shift_delay;
+    unsigned long flags;
+    int rc = 0;
+
+    spin_lock_irqsave(&prv->lock, flags);
+
+    if ( op->cmd == XEN_SYSCTL_SCHEDOP_putinfo )
+    {
+	min_global_slice = params->min_global_slice ? params->min_global_slice : prv->min_global_slice;
+	shift_delay = params->shift_delay ? params->shift_delay : prv->shift_delay;
+
+	if(min_global_slice < SLICE_MIN || shift_delay >= min_global_slice ||
+		(params->extra_quantum && params->extra_quantum < SLICE_MIN) ||
+		params->full_slack >= 100000)
+	{
+	    rc = -EINVAL;
+	    goto out;
+	}
+
+	prv->min_global_slice = min_global_slice;
+	prv->shift_delay = shift_delay;
+	if(params->extra_quantum)
+	    prv->extra_quantum = params->extra_quantum;
+	if(params->full_slack)
+	    prv->full_slack = params->full_slack;
+
+	if(params->calibrate)
+	    sc_calibrate_start(prv);
+    }
+    else if ( op->cmd == XEN_SYSCTL_SCHEDOP_getinfo )
+    {
+	params->min_global_slice = prv->min_global_slice;
+	params->shift_delay = prv->shift_delay;
+	params->extra_quantum = prv->extra_quantum;
+	params->full_slack = prv->full_slack;
+	params->calibrate = prv->calibrating;
+    }
+    else
+	rc = -EINVAL;
+
+out:
+    spin_unlock_irqrestore(&prv->lock, flags);
+
     return rc;
 }
 
 /*
+ * Called on a CPU once the switch away from vc is done and the VCPU now
+ * current here has its context loaded. The time since schedule() started
+ * the switch, the now sc_do_schedule() stamped into sched_start_abs, is
+ * what it cost. A VCPU that last ran on another CPU has to bring its state
+ * over, which is the price a split VCPU pays twice a slice, so that goes
+ * into handoff_cost instead. That handoff starts here too: the CPU vc moved
+ * to gets an IPI the moment its state is saved.
+ */
 static void sc_context_saved(const struct scheduler *ops, struct vcpu *vc)
 {
-    //struct sc_priv_info *prv = SC_PRIV(ops);
-    struct sc_vcpu_info* inf = EDOM_INFO(vc);
+    struct vcpu *next = current;
+    struct sc_vcpu_info *inf;
+    int cpu = smp_processor_id();
 
-    if ( unlikely(is_idle_vcpu(vc)))
+    // vc moved on while it was still running here
+    if(!is_idle_vcpu(vc) && vc->processor != cpu)
+	cpu_raise_softirq(vc->processor, SCHEDULE_SOFTIRQ);
+
+    if ( unlikely(is_idle_vcpu(next)) )
 	return;
 
-    DPRINTK3("------ CPU: %d - %d - %s - VM: %d.%d ------\n",
-	    smp_processor_id(),
-	    vc->processor,
-	    __func__,
-	    vc->domain->domain_id,
-	    vc->vcpu_id);
+    inf = EDOM_INFO(next);
 
-    inf->status &= ~SC_RUNNING;
+    if(inf->last_cpu == cpu)
+	sc_cost_sample(&CPU_INFO(cpu)->switch_cost, NOW() - inf->sched_start_abs);
+    else if(inf->last_cpu >= 0)
+	sc_cost_sample(&CPU_INFO(cpu)->handoff_cost, NOW() - inf->sched_start_abs);
 
-   if(!(prv->status & SC_CPU0_BUSY) &&
-	    vc->processor != smp_processor_id() &&
-	    is_idle_vcpu(per_cpu(schedule_data, inf->vcpu->processor).curr))
-	cpu_raise_softirq(inf->vcpu->processor, SCHEDULE_SOFTIRQ);
+    inf->last_cpu = cpu;
 }
-*/
 
 static struct sc_priv_info _sc_priv;
 
@@ -3204,7 +4979,8 @@ const struct scheduler sched_sc_def = {
     .sleep          = sc_sleep,
     .wake           = sc_wake,
     .adjust         = sc_adjust,
-    //.context_saved  = sc_context_saved,
+    .adjust_global  = sc_adjust_global,
+    .context_saved  = sc_context_saved,
 };
 
 /*
@@ -1195,7 +1195,8 @@ long sched_adjust(struct domain *d, struct xen_domctl_scheduler_op *op)
 
     if ( (op->sched_id != DOM2OP(d)->sched_id) ||
          ((op->cmd != XEN_DOMCTL_SCHEDOP_putinfo) &&
-          (op->cmd != XEN_DOMCTL_SCHEDOP_getinfo)) )
+          (op->cmd != XEN_DOMCTL_SCHEDOP_getinfo) &&
+          (op->cmd != XEN_DOMCTL_SCHEDOP_putvcpuinfo)) )
         return -EINVAL;
 
     /* NB: the pluggable scheduler code needs to take care
@@ -1315,9 +1316,10 @@ static void schedule(void)
     {
 	si = (struct shared_info *) prev->domain->shared_info;
 
-	if(si->extra_arg2[prev->vcpu_id] == 5)
+	if(si->rtvirt[prev->vcpu_id].version == XEN_RTVIRT_CHANNEL_VERSION &&
+		si->rtvirt[prev->vcpu_id].query == XEN_RTVIRT_QUERY_DUMP)
 	{
-	    si->extra_arg2[prev->vcpu_id] = 0;
+	    si->rtvirt[prev->vcpu_id].query = 0;
 	    sc_debugging2 = 2;
 	}
     }
@@ -1842,6 +1844,15 @@ void wait(void)
 #include "compat/schedule.c"
 #endif
 
+/*
+ * Set the bandwidth of one of the calling domain's VCPUs. Guests that change
+ * several at a time should use do_sched_setschedcross_batch() instead.
+ *
+ * Neither waits for the change to be in force: once admitted it is staged
+ * for the next repartition, and its ticket left in the rtvirt_notify of the
+ * domain's shared info. VIRQ_RTVIRT tells the guest when done caught up
+ * with it, and effective holds the boundary it took effect at.
+ */
 ret_t do_sched_setschedcross(int pid, unsigned long runtime, unsigned long period)
 {
     struct xen_domctl_scheduler_op op;
@@ -1862,7 +1873,33 @@ ret_t do_sched_setschedcross(int pid, unsigned long runtime, unsigned long perio
 
     ret = sched_adjust(d, &op);
 
-    printk("pid: %d, runtime:%lu, period:%lu\n", pid, runtime, period);
+    rcu_unlock_domain(d);
+
+    return ret;
+}
+
+/*
+ * Set the bandwidth of nr of the calling domain's VCPUs at once, each entry
+ * a vcpuid and a (period, slice) in u.sc. All of them are checked before any
+ * is applied, the host is repartitioned once for the lot, and each entry's
+ * status says how it fared.
+ */
+ret_t do_sched_setschedcross_batch(
+    XEN_GUEST_HANDLE_PARAM(xen_domctl_schedparam_vcpu_t) vcpus, unsigned int nr)
+{
+    struct xen_domctl_scheduler_op op;
+    struct domain *d;
+    long ret;
+
+    if ( (d = rcu_lock_domain_by_id(current->domain->domain_id)) == NULL )
+        return -ESRCH;
+
+    op.sched_id = sched_id();
+    op.cmd = XEN_DOMCTL_SCHEDOP_putvcpuinfo;
+    op.u.v.vcpus = guest_handle_from_param(vcpus, xen_domctl_schedparam_vcpu_t);
+    op.u.v.nr_vcpus = nr;
+
+    ret = sched_adjust(d, &op);
 
     rcu_unlock_domain(d);
 
@@ -0,0 +1,3 @@
+/* See sim-shim.h */
+#include <xen/sim-shim.h>
+#include <errno.h>
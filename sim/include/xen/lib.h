@@ -0,0 +1,2 @@
+/* See sim-shim.h */
+#include <xen/sim-shim.h>
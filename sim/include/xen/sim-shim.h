@@ -0,0 +1,552 @@
+/******************************************************************************
+ * Host-side stand-ins for the parts of the Xen API used by sched_rtvirt.c
+ *
+ * Everything here is single threaded: the simulator runs one pCPU at a time
+ * and sets sim_cpu/sim_now before calling into the scheduler, so locks and
+ * atomics only need to get the bookkeeping right, not the memory ordering.
+ ******************************************************************************/
+
+#ifndef __SIM_SHIM_H__
+#define __SIM_SHIM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+typedef int64_t s_time_t;
+typedef uint64_t u64;
+typedef uint32_t u32;
+typedef uint16_t u16;
+typedef uint8_t u8;
+typedef unsigned char bool_t;
+typedef uint16_t domid_t;
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define NR_CPUS          256
+#define SIM_MAX_VCPUS    32
+#define DOMID_IDLE       32767
+#define DOMID_INVALID    32756
+
+/* Time */
+extern s_time_t sim_now;
+#define NOW()           (sim_now)
+#define SECONDS(_s)     ((s_time_t)((_s)  * 1000000000ULL))
+#define MILLISECS(_ms)  ((s_time_t)((_ms) * 1000000ULL))
+#define MICROSECS(_us)  ((s_time_t)((_us) * 1000ULL))
+
+/* Console and assertions */
+int sim_printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void sim_bug(const char *file, int line);
+#define printk(_f...)   sim_printk(_f)
+#define ASSERT(_p)      ((void)0)
+#define BUG_ON(_p)      do { if ( _p ) sim_bug(__FILE__, __LINE__); } while ( 0 )
+#define BUG()           sim_bug(__FILE__, __LINE__)
+
+/* Allocation */
+#define xzalloc(_t)           ((_t *)calloc(1, sizeof(_t)))
+#define xzalloc_array(_t, _n) ((_t *)calloc((_n), sizeof(_t)))
+#define xmalloc_array(_t, _n) ((_t *)malloc((_n) * sizeof(_t)))
+#define xfree(_p)             free(_p)
+
+#define ARRAY_SIZE(_a) (sizeof(_a) / sizeof((_a)[0]))
+
+/* Boot parameters keep their defaults */
+#define __read_mostly
+#define boolean_param(_name, _var)
+
+#define min(x, y) ({ typeof(x) _x = (x); typeof(y) _y = (y); _x < _y ? _x : _y; })
+#define max(x, y) ({ typeof(x) _x = (x); typeof(y) _y = (y); _x > _y ? _x : _y; })
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* Doubly linked lists, with the same poisoning semantics as Xen */
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_POISON1  ((void *) 0x00100100)
+#define LIST_POISON2  ((void *) 0x00200200)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new,
+                              struct list_head *prev,
+                              struct list_head *next)
+{
+    next->prev = new;
+    new->next = next;
+    new->prev = prev;
+    prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+    __list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+    __list_add(new, head->prev, head);
+}
+
+static inline void __list_del(struct list_head *prev, struct list_head *next)
+{
+    next->prev = prev;
+    prev->next = next;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    __list_del(entry->prev, entry->next);
+    entry->next = LIST_POISON1;
+    entry->prev = LIST_POISON2;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+    __list_del(entry->prev, entry->next);
+    INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move(struct list_head *list, struct list_head *head)
+{
+    __list_del(list->prev, list->next);
+    list_add(list, head);
+}
+
+static inline void list_move_tail(struct list_head *list,
+                                  struct list_head *head)
+{
+    __list_del(list->prev, list->next);
+    list_add_tail(list, head);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+#define list_for_each(pos, head) \
+    for ( pos = (head)->next; pos != (head); pos = pos->next )
+
+#define list_for_each_safe(pos, n, head) \
+    for ( pos = (head)->next, n = pos->next; pos != (head); \
+          pos = n, n = pos->next )
+
+#define list_for_each_entry(pos, head, member)                        \
+    for ( pos = list_entry((head)->next, __typeof__(*pos), member);   \
+          &pos->member != (head);                                     \
+          pos = list_entry(pos->member.next, __typeof__(*pos), member) )
+
+/* Locks and atomics */
+typedef struct { int held; } spinlock_t;
+#define spin_lock_init(_l)               ((_l)->held = 0)
+#define spin_lock(_l)                    ((_l)->held++)
+#define spin_unlock(_l)                  ((_l)->held--)
+#define spin_lock_irqsave(_l, _f)        ((_f) = 0, (_l)->held++)
+#define spin_unlock_irqrestore(_l, _f)   ((void)(_f), (_l)->held--)
+
+typedef struct { int counter; } atomic_t;
+#define atomic_read(_v)      ((_v)->counter)
+#define atomic_set(_v, _i)   ((_v)->counter = (_i))
+#define atomic_inc(_v)       ((_v)->counter++)
+#define atomic_dec(_v)       ((_v)->counter--)
+
+#define read_atomic(_p)      (*(_p))
+#define write_atomic(_p, _x) (*(_p) = (_x))
+#define smp_mb()             ((void)0)
+#define smp_rmb()            ((void)0)
+#define smp_wmb()            ((void)0)
+#define cmpxchg(_p, _o, _n) ({                  \
+    __typeof__(*(_p)) __old = *(_p);            \
+    if ( __old == (_o) )                        \
+        *(_p) = (_n);                           \
+    __old;                                      \
+})
+
+/* CPU masks */
+typedef struct {
+    unsigned long bits[NR_CPUS / (8 * sizeof(unsigned long))];
+} cpumask_t;
+
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+static inline int cpumask_test_cpu(int cpu, const cpumask_t *m)
+{
+    return !!(m->bits[cpu / BITS_PER_LONG] & (1UL << (cpu % BITS_PER_LONG)));
+}
+
+static inline void cpumask_set_cpu(int cpu, cpumask_t *m)
+{
+    m->bits[cpu / BITS_PER_LONG] |= 1UL << (cpu % BITS_PER_LONG);
+}
+
+static inline void cpumask_clear_cpu(int cpu, cpumask_t *m)
+{
+    m->bits[cpu / BITS_PER_LONG] &= ~(1UL << (cpu % BITS_PER_LONG));
+}
+
+static inline void cpumask_clear(cpumask_t *m)
+{
+    memset(m->bits, 0, sizeof(m->bits));
+}
+
+static inline void cpumask_copy(cpumask_t *dst, const cpumask_t *src)
+{
+    *dst = *src;
+}
+
+static inline int cpumask_last(const cpumask_t *m)
+{
+    int cpu;
+
+    for ( cpu = NR_CPUS - 1; cpu >= 0; cpu-- )
+        if ( cpumask_test_cpu(cpu, m) )
+            return cpu;
+    return NR_CPUS;
+}
+
+static inline int cpumask_weight(const cpumask_t *m)
+{
+    int cpu, n = 0;
+
+    for ( cpu = 0; cpu < NR_CPUS; cpu++ )
+        n += cpumask_test_cpu(cpu, m);
+    return n;
+}
+
+extern cpumask_t cpu_online_map;
+extern unsigned int nr_cpu_ids;
+
+/* First set CPU after cpu, or nr_cpu_ids if there is none */
+static inline int cpumask_next(int cpu, const cpumask_t *m)
+{
+    unsigned long word;
+    unsigned int i;
+
+    if ( ++cpu >= nr_cpu_ids )
+        return nr_cpu_ids;
+
+    i = cpu / BITS_PER_LONG;
+    word = m->bits[i] & (~0UL << (cpu % BITS_PER_LONG));
+    while ( word == 0 )
+    {
+        if ( ++i * BITS_PER_LONG >= nr_cpu_ids )
+            return nr_cpu_ids;
+        word = m->bits[i];
+    }
+
+    cpu = i * BITS_PER_LONG + __builtin_ctzl(word);
+    return cpu < nr_cpu_ids ? cpu : nr_cpu_ids;
+}
+
+static inline int cpumask_first(const cpumask_t *m)
+{
+    return cpumask_next(-1, m);
+}
+
+#define for_each_cpu(_cpu, _m)                          \
+    for ( (_cpu) = cpumask_first(_m);                   \
+          (_cpu) < nr_cpu_ids;                          \
+          (_cpu) = cpumask_next(_cpu, _m) )
+
+#define cpu_online(_cpu)             cpumask_test_cpu(_cpu, &cpu_online_map)
+#define for_each_online_cpu(_cpu)    for_each_cpu(_cpu, &cpu_online_map)
+
+typedef cpumask_t *cpumask_var_t;
+
+/* Domains and VCPUs */
+/*
+ * Per-VCPU RT channel between a guest's RT scheduler and sched_rtvirt.c,
+ * one cacheline each. The guest fills it in and sets version last; Xen
+ * ignores a channel whose version it does not speak.
+ *
+ * hint[] is a single-producer/single-consumer ring of the deadlines the
+ * guest wants next: the guest writes hint[prod % XEN_RTVIRT_RING_SIZE],
+ * then bumps prod, and must not get more than XEN_RTVIRT_RING_SIZE ahead
+ * of cons, which only Xen bumps. Xen publishes the deadline in force, and
+ * answers a query the guest set with the result and query back at 0.
+ */
+#define XEN_RTVIRT_CHANNEL_VERSION  1
+#define XEN_RTVIRT_RING_SIZE        4
+#define XEN_RTVIRT_QUERY_CPUTIME    1   /* cputime, through putinfo */
+#define XEN_RTVIRT_QUERY_DUMP       2   /* scheduler state to the console */
+
+struct xen_rtvirt_channel {
+    uint32_t version;
+    uint32_t query;
+    uint32_t prod;
+    uint32_t cons;
+    uint64_t deadline;
+    uint64_t cputime;
+    uint64_t hint[XEN_RTVIRT_RING_SIZE];
+};
+
+/*
+ * Per-domain completion of the bandwidth changes a guest hands in. Xen bumps
+ * requested for every change it takes in, before the hypercall returns;
+ * once the CPUs are repartitioned for it, it writes the global boundary it
+ * took effect at to effective, then done, and sends VIRQ_RTVIRT. A guest
+ * waits until done has caught up with the requested it read, and reads
+ * effective between two reads of done that agree.
+ */
+#define VIRQ_RTVIRT                 14
+
+struct xen_rtvirt_notify {
+    uint32_t requested;
+    uint32_t done;
+    uint64_t effective;
+};
+
+struct shared_info {
+    struct xen_rtvirt_channel rtvirt[SIM_MAX_VCPUS];
+    struct xen_rtvirt_notify rtvirt_notify;
+    unsigned long extra_arg6[SIM_MAX_VCPUS];
+    unsigned long extra_arg7[SIM_MAX_VCPUS];
+    unsigned long extra_arg8[SIM_MAX_VCPUS];
+    unsigned long extra_arg9[SIM_MAX_VCPUS];
+    unsigned long extra_arg10[SIM_MAX_VCPUS];
+};
+
+struct cpupool;
+
+struct domain {
+    domid_t          domain_id;
+    struct shared_info *shared_info;
+    struct vcpu    **vcpu;
+    unsigned int     max_vcpus;
+    void            *sched_priv;
+    struct cpupool  *cpupool;
+};
+
+struct vcpu {
+    int              vcpu_id;
+    int              processor;
+    bool_t           is_running;
+    void            *sched_priv;
+    struct domain   *domain;
+    struct vcpu     *next_in_list;
+
+    /* Simulator state, standing in for pause_flags/pause_count. */
+    bool_t           sim_runnable;
+};
+
+/* Domains never go away under the scheduler here */
+#define get_domain(_d)                 ((void)(_d), 1)
+#define put_domain(_d)                 ((void)(_d))
+
+/* Events: counted, the guests here do not wait on them */
+void send_guest_global_virq(struct domain *d, uint32_t virq);
+
+#define for_each_vcpu(_d, _v)                    \
+    for ( (_v) = (_d)->vcpu ? (_d)->vcpu[0] : NULL; \
+          (_v) != NULL;                          \
+          (_v) = (_v)->next_in_list )
+
+#define is_idle_vcpu(_v)    ((_v)->domain->domain_id == DOMID_IDLE)
+#define vcpu_runnable(_v)   ((_v)->sim_runnable)
+
+extern struct vcpu *idle_vcpu[NR_CPUS];
+
+/* Per-CPU scheduler state */
+struct schedule_data {
+    spinlock_t      *schedule_lock, _lock;
+    struct vcpu     *curr;
+    void            *sched_priv;
+};
+
+extern struct schedule_data sim_percpu_schedule_data[NR_CPUS];
+extern struct cpupool *sim_percpu_cpupool[NR_CPUS];
+/* Topology, see sim_topology() */
+extern cpumask_var_t sim_percpu_cpu_sibling_mask[NR_CPUS];
+extern cpumask_var_t sim_percpu_cpu_core_mask[NR_CPUS];
+#define per_cpu(_var, _cpu)  (sim_percpu_##_var[_cpu])
+
+extern int sim_cpu;
+#define smp_processor_id()   (sim_cpu)
+#define current              (per_cpu(schedule_data, sim_cpu).curr)
+
+#define cpupool_scheduler_cpumask(_pool)  ((void)(_pool), &cpu_online_map)
+
+/* Softirqs */
+#define SCHEDULE_SOFTIRQ 0
+void sim_raise_softirq(unsigned int cpu);
+void sim_raise_softirq_mask(const cpumask_t *mask);
+#define cpu_raise_softirq(_cpu, _nr) sim_raise_softirq(_cpu)
+#define cpumask_raise_softirq(_mask, _nr) sim_raise_softirq_mask(_mask)
+
+/* Tasklets: the driver runs them once the softirqs of a time step settle */
+struct tasklet {
+    struct list_head list;
+    int              scheduled_on;
+    void           (*func)(unsigned long);
+    unsigned long    data;
+};
+
+void tasklet_init(struct tasklet *t, void (*func)(unsigned long),
+                  unsigned long data);
+void tasklet_schedule_on_cpu(struct tasklet *t, unsigned int cpu);
+void tasklet_kill(struct tasklet *t);
+#define tasklet_schedule(_t) tasklet_schedule_on_cpu(_t, smp_processor_id())
+
+/* Tracing: xentrace records, written to a file by the driver when asked */
+#define TRC_SCHED_CLASS      0x00022000
+#define TRC_SCHED_VERBOSE    0x00028000
+#define TRC_SCHED_SWITCH     (TRC_SCHED_VERBOSE + 10)
+#define TRC_SCHED_ID_BITS    3
+#define TRC_SCHED_ID_SHIFT   (12 - TRC_SCHED_ID_BITS)
+#define TRC_SCHED_ID_MASK    (((1UL << TRC_SCHED_ID_BITS) - 1) << TRC_SCHED_ID_SHIFT)
+#define TRC_SCHED_EVT_MASK   (~(TRC_SCHED_ID_MASK))
+#define TRC_SCHED_CLASS_EVT(_c, _e)                                      \
+    ((TRC_SCHED_CLASS |                                                 \
+      ((TRC_SCHED_##_c << TRC_SCHED_ID_SHIFT) & TRC_SCHED_ID_MASK)) +   \
+     ((_e) & TRC_SCHED_EVT_MASK))
+
+extern int tb_init_done;
+void __trace_var(uint32_t event, bool_t cycles, unsigned int extra,
+                 const void *extra_data);
+
+#define __TRACE_D(_e, _d...) do {                                       \
+    if ( unlikely(tb_init_done) )                                       \
+    {                                                                   \
+        uint32_t _x[] = { _d };                                         \
+        __trace_var(_e, 1, sizeof(_x), _x);                             \
+    }                                                                   \
+} while ( 0 )
+#define TRACE_1D(_e, _d...)  __TRACE_D(_e, _d)
+#define TRACE_2D(_e, _d...)  __TRACE_D(_e, _d)
+#define TRACE_3D(_e, _d...)  __TRACE_D(_e, _d)
+#define TRACE_4D(_e, _d...)  __TRACE_D(_e, _d)
+#define TRACE_5D(_e, _d...)  __TRACE_D(_e, _d)
+
+/* Scheduler interface */
+struct task_slice {
+    struct vcpu *task;
+    s_time_t     time;
+    bool_t       migrated;
+};
+
+#define XEN_SCHEDULER_SC            9
+#define XEN_DOMCTL_SCHEDOP_putinfo      0
+#define XEN_DOMCTL_SCHEDOP_getinfo      1
+#define XEN_DOMCTL_SCHEDOP_putvcpuinfo  2
+
+/* Guest handles are plain pointers here, and copies never fault */
+#define XEN_GUEST_HANDLE_64(_t)         struct { _t *p; }
+#define set_xen_guest_handle(_h, _v)    ((_h).p = (_v))
+#define copy_from_guest(_d, _h, _n)     \
+    (memcpy(_d, (_h).p, (_n) * sizeof(*(_d))), 0)
+#define copy_to_guest(_h, _s, _n)       \
+    (memcpy((_h).p, _s, (_n) * sizeof(*(_s))), 0)
+
+struct xen_domctl_sched_sc {
+    uint64_t period;
+    uint64_t slice;
+    uint64_t latency;
+    uint32_t extratime;
+    uint32_t weight;
+    uint32_t left;      /* OUT: on -ENOSPC, the bandwidth left (1/100000 CPU) */
+    uint32_t padding;
+};
+
+typedef struct xen_domctl_schedparam_vcpu {
+    union {
+        struct xen_domctl_sched_sc sc;
+    } u;
+    uint32_t vcpuid;
+    int32_t  status;    /* OUT: 0, or why this entry held the batch back */
+} xen_domctl_schedparam_vcpu_t;
+
+struct xen_domctl_scheduler_op {
+    uint32_t sched_id;
+    uint32_t cpupool_id;
+    uint32_t cmd;
+    union {
+        struct xen_domctl_sched_sc sc;
+        struct {
+            XEN_GUEST_HANDLE_64(xen_domctl_schedparam_vcpu_t) vcpus;
+            uint32_t nr_vcpus;
+            uint32_t left;  /* OUT: on -ENOSPC, the bandwidth left (1/100000 CPU) */
+        } v;
+    } u;
+};
+
+#define XEN_SYSCTL_SCHEDOP_putinfo      0
+#define XEN_SYSCTL_SCHEDOP_getinfo      1
+
+struct xen_sysctl_sched_sc {
+    uint64_t min_global_slice;
+    uint64_t shift_delay;
+    uint64_t extra_quantum;
+    uint32_t full_slack;
+    uint32_t calibrate;
+};
+
+struct xen_sysctl_scheduler_op {
+    uint32_t cpupool_id;
+    uint32_t sched_id;
+    uint32_t cmd;
+    union {
+        struct xen_sysctl_sched_sc sc;
+    } u;
+};
+
+struct scheduler {
+    char *name;
+    char *opt_name;
+    unsigned int sched_id;
+    void *sched_data;
+
+    int          (*global_init)    (void);
+    int          (*init)           (struct scheduler *);
+    void         (*deinit)         (const struct scheduler *);
+
+    void         (*free_vdata)     (const struct scheduler *, void *);
+    void *       (*alloc_vdata)    (const struct scheduler *, struct vcpu *,
+                                    void *);
+    void         (*free_pdata)     (const struct scheduler *, void *, int);
+    void *       (*alloc_pdata)    (const struct scheduler *, int);
+    void         (*free_domdata)   (const struct scheduler *, void *);
+    void *       (*alloc_domdata)  (const struct scheduler *, struct domain *);
+
+    int          (*init_domain)    (const struct scheduler *, struct domain *);
+    void         (*destroy_domain) (const struct scheduler *, struct domain *);
+
+    void         (*remove_vcpu)    (const struct scheduler *, struct vcpu *);
+    void         (*insert_vcpu)    (const struct scheduler *, struct vcpu *);
+
+    void         (*sleep)          (const struct scheduler *, struct vcpu *);
+    void         (*wake)           (const struct scheduler *, struct vcpu *);
+    void         (*yield)          (const struct scheduler *, struct vcpu *);
+    void         (*context_saved)  (const struct scheduler *, struct vcpu *);
+
+    struct task_slice (*do_schedule) (const struct scheduler *, s_time_t,
+                                      bool_t tasklet_work_scheduled);
+
+    int          (*pick_cpu)       (const struct scheduler *, struct vcpu *);
+    void         (*migrate)        (const struct scheduler *, struct vcpu *,
+                                    unsigned int);
+    int          (*adjust)         (const struct scheduler *, struct domain *,
+                                    struct xen_domctl_scheduler_op *);
+    int          (*adjust_global)  (const struct scheduler *,
+                                    struct xen_sysctl_scheduler_op *);
+    void         (*dump_settings)  (const struct scheduler *);
+    void         (*dump_cpu_state) (const struct scheduler *, int);
+
+    void         (*tick_suspend)   (const struct scheduler *, unsigned int);
+    void         (*tick_resume)    (const struct scheduler *, unsigned int);
+};
+
+#endif /* __SIM_SHIM_H__ */
@@ -0,0 +1,208 @@
+/******************************************************************************
+ * Per-boundary cost of the RTVirt scheduler
+ *
+ * Includes sched_rtvirt.c directly so the static boundary path can be timed
+ * on its own: one pCPU gets a runq of N periodic VCPUs (every eighth one
+ * split) and calculate_new_local_deadlines() is run over it again and
+ * again, as at a global boundary. The same VCPUs are then repartitioned
+ * over the pCPUs with sc_plan_build(), as after a bandwidth change: once
+ * from scratch, and once more after only the last VCPU changed.
+ *
+ * Usage: rtvirt-bench [-n vcpus] [-c cpus] [-i iterations]
+ ******************************************************************************/
+
+#include <time.h>
+#include <unistd.h>
+#include "../sched_rtvirt.c"
+#include "sim.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define bench_ticks()  __rdtsc()
+#define BENCH_UNIT     "cycles"
+#else
+static uint64_t bench_ticks(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#define BENCH_UNIT     "ns"
+#endif
+
+#define BENCH_CPU 1
+
+static struct scheduler ops;
+static struct domain bench_domain;
+
+static void setup(int nr_vcpus, int nr_cpus)
+{
+    struct sc_vcpu_info *inf;
+    struct vcpu *v;
+    int cpu, i;
+
+    nr_cpu_ids = nr_cpus;
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        cpumask_set_cpu(cpu, &cpu_online_map);
+    sim_topology(nr_cpus, 1, 1);
+
+    ops = sched_sc_def;
+    BUG_ON(ops.init(&ops));
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        per_cpu(schedule_data, cpu).sched_priv = ops.alloc_pdata(&ops, cpu);
+
+    bench_domain.domain_id = 1;
+    bench_domain.shared_info = xzalloc(struct shared_info);
+    bench_domain.vcpu = xzalloc_array(struct vcpu *, nr_vcpus);
+    BUG_ON(bench_domain.shared_info == NULL || bench_domain.vcpu == NULL);
+
+    for ( i = 0; i < nr_vcpus; i++ )
+    {
+        v = xzalloc(struct vcpu);
+        BUG_ON(v == NULL);
+        v->vcpu_id = i % SIM_MAX_VCPUS;
+        v->processor = BENCH_CPU;
+        v->domain = &bench_domain;
+        v->sim_runnable = 1;
+        bench_domain.vcpu[i] = v;
+
+        v->sched_priv = ops.alloc_vdata(&ops, v, NULL);
+        BUG_ON(v->sched_priv == NULL);
+        inf = EDOM_INFO(v);
+
+        inf->status = 0;
+        inf->period_new = 100000;
+        inf->slice_new = 100000 / nr_vcpus + (i % 7) * 13;
+        if ( i % 8 == 7 )
+        {
+            inf->status |= SC_SPLIT;
+            inf->processor_a = BENCH_CPU - 1;
+            inf->processor_b = BENCH_CPU;
+            inf->period_a = inf->period_b = 300000;
+            inf->slice_a = 3 * inf->slice_new / 2;
+            inf->slice_b = 3 * inf->slice_new - inf->slice_a;
+        }
+        sc_update_shares(inf);
+
+        /* Fill all but dom0's pCPU to 90% when repartitioning. */
+        inf->period_temp = 10000 + (i % 5) * 10000;
+        inf->slice_temp = inf->period_temp * 9 * (nr_cpus - 1) / 10 / nr_vcpus;
+        if ( inf->slice_temp < 1 )
+            inf->slice_temp = 1;
+        /* sc_plan_build() only places admitted VCPUs. */
+        sc_admitted(SC_PRIV(&ops), inf,
+                    sc_bw(v, inf->period_temp * 1000, inf->slice_temp * 1000),
+                    sc_rate(v, inf->period_temp * 1000));
+
+        list_add_tail(&inf->list, RUNQ(BENCH_CPU));
+        list_add_tail(&inf->sc_list, &SC_PRIV(&ops)->sc_list_head);
+    }
+}
+
+static void report(const char *what, uint64_t sum, uint64_t best,
+                   int iterations, int per)
+{
+    printf("%s_%-*s %"PRIu64" avg, %"PRIu64" best, %.1f per vcpu\n",
+           what, (int)(17 - strlen(what)), BENCH_UNIT, sum / iterations, best,
+           (double)sum / iterations / per);
+}
+
+int main(int argc, char **argv)
+{
+    int nr_vcpus = 64, nr_cpus = 64, iterations = 100000, i, opt;
+    struct sc_priv_info *prv;
+    struct sc_vcpu_info *inf;
+    uint64_t t0, t1, best = ~0ULL, sum = 0;
+
+    while ( (opt = getopt(argc, argv, "n:c:i:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'n': nr_vcpus = atoi(optarg); break;
+        case 'c': nr_cpus = atoi(optarg); break;
+        case 'i': iterations = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n vcpus] [-c cpus] [-i iterations]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if ( nr_vcpus < 1 || iterations < 1 || nr_cpus < BENCH_CPU + 2 ||
+         nr_cpus > NR_CPUS )
+        return 1;
+
+    setup(nr_vcpus, nr_cpus);
+    prv = SC_PRIV(&ops);
+
+    sim_cpu = BENCH_CPU;
+    prv->global_slice_start = MILLISECS(10);
+    prv->global_deadline = prv->global_slice_start + MILLISECS(7) + 12345;
+
+    for ( i = 0; i < iterations; i++ )
+    {
+        t0 = bench_ticks();
+        calculate_new_local_deadlines(BENCH_CPU, prv->global_slice_start,
+                                      prv->global_slice_start, prv->global_deadline, &ops);
+        t1 = bench_ticks();
+
+        sum += t1 - t0;
+        if ( t1 - t0 < best )
+            best = t1 - t0;
+    }
+
+    printf("vcpus              %d\n", nr_vcpus);
+    printf("pcpus              %d\n", nr_cpus);
+    report("boundary", sum, best, iterations, nr_vcpus);
+
+    /* Dom0 keeps pCPU 0 to itself, as in the simulator. */
+    prv->dom0_cpu_count = 1;
+    sc_plan_set(prv->plan, 0, 100000, 100000);
+
+    sum = 0;
+    best = ~0ULL;
+    iterations = (iterations + 9) / 10;
+    for ( i = 0; i < iterations; i++ )
+    {
+        /* Otherwise the shadow plan is up to date and nothing is built. */
+        prv->plan_version++;
+
+        t0 = bench_ticks();
+        sc_plan_build(prv);
+        t1 = bench_ticks();
+
+        sum += t1 - t0;
+        if ( t1 - t0 < best )
+            best = t1 - t0;
+    }
+
+    report("repartition", sum, best, iterations, nr_vcpus);
+
+    /* Publish that plan, then change the last VCPU only. */
+    sc_plan_publish(prv);
+    list_for_each_entry ( inf, &prv->sc_list_head, sc_list )
+        dp_wrap_apply(prv, inf->vcpu, &inf->next_assign);
+    inf = list_entry(prv->sc_list_head.prev, struct sc_vcpu_info, sc_list);
+
+    sum = 0;
+    best = ~0ULL;
+    for ( i = 0; i < iterations; i++ )
+    {
+        prv->plan_from = NR_CPUS;
+        sc_plan_dirty(prv, inf);
+        prv->plan_version++;
+
+        t0 = bench_ticks();
+        sc_plan_build(prv);
+        t1 = bench_ticks();
+
+        sum += t1 - t0;
+        if ( t1 - t0 < best )
+            best = t1 - t0;
+    }
+
+    report("incremental", sum, best, iterations, nr_vcpus);
+
+    return 0;
+}
@@ -0,0 +1,731 @@
+/******************************************************************************
+ * Self-checks for the RTVirt scheduler's partitioning
+ *
+ * Includes sched_rtvirt.c directly, as rtvirt-bench does, so the plans
+ * sc_plan_build() makes can be looked at. A host of -L packages with -H SMT
+ * threads per core is set up, and the bandwidth of random VCPUs changed
+ * round after round, each round ending in a published plan as at a global
+ * boundary. Every check that fails is printed, and rtvirt-check exits with
+ * status 1 if any did.
+ *
+ *  topology     SMT siblings are next to each other in the fill order,
+ *               every package's CPUs are too, and no split VCPU leaves its
+ *               package while the load leaves room enough to keep it in.
+ *  incremental  A plan built from plan_from on comes out as a model built
+ *               over every VCPU says, and keeps sc_list_head in order.
+ *  stability    A VCPU giving bandwidth back sends nobody to a CPU it was
+ *               not on, and repartitions move far fewer VCPUs than placing
+ *               them all from scratch would.
+ *  batch        Batched putvcpuinfo reports bad, missing, duplicate and
+ *               oversized entries per entry and changes nothing for them,
+ *               and a batch let in is repartitioned for once.
+ *
+ * Usage: rtvirt-check [-c cpus] [-L llcs] [-H threads] [-n vcpus]
+ *                     [-r rounds] [-s seed]
+ ******************************************************************************/
+
+#include <unistd.h>
+#include "../sched_rtvirt.c"
+#include "sim.h"
+
+/* Largest bandwidth a VCPU is given, in 1/100000 CPU */
+#define CHECK_MAX_BW  50000
+
+static struct scheduler ops;
+static struct domain check_domain;
+static int nr_llcs = 4;
+static unsigned long failures;
+
+#define EXPECT(cond, fmt, args...) do {                 \
+    if ( !(cond) )                                      \
+    {                                                   \
+        failures++;                                     \
+        printf("FAIL: " fmt "\n", ## args);             \
+    }                                                   \
+} while ( 0 )
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void setup(int nr_vcpus, int nr_cpus, int threads)
+{
+    struct sc_priv_info *prv;
+    struct vcpu *v;
+    int cpu, i;
+
+    nr_cpu_ids = nr_cpus;
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        cpumask_set_cpu(cpu, &cpu_online_map);
+    sim_topology(nr_cpus, nr_llcs, threads);
+
+    ops = sched_sc_def;
+    BUG_ON(ops.init(&ops));
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        per_cpu(schedule_data, cpu).sched_priv = ops.alloc_pdata(&ops, cpu);
+
+    /* Dom0 keeps pCPU 0 to itself, as in the simulator. */
+    prv = SC_PRIV(&ops);
+    prv->dom0_cpu_count = 1;
+    prv->plan_reorder = 1;
+
+    check_domain.domain_id = 1;
+    check_domain.max_vcpus = nr_vcpus;
+    check_domain.shared_info = xzalloc(struct shared_info);
+    check_domain.vcpu = xzalloc_array(struct vcpu *, nr_vcpus);
+    BUG_ON(check_domain.shared_info == NULL || check_domain.vcpu == NULL);
+    BUG_ON(ops.init_domain(&ops, &check_domain));
+
+    for ( i = 0; i < nr_vcpus; i++ )
+    {
+        v = xzalloc(struct vcpu);
+        BUG_ON(v == NULL);
+        v->vcpu_id = i % SIM_MAX_VCPUS;
+        v->processor = 1;
+        v->domain = &check_domain;
+        check_domain.vcpu[i] = v;
+
+        v->sched_priv = ops.alloc_vdata(&ops, v, NULL);
+        BUG_ON(v->sched_priv == NULL);
+        EDOM_INFO(v)->status = 0;
+        list_add_tail(&EDOM_INFO(v)->sc_list, &prv->sc_list_head);
+    }
+}
+
+/* Stage bw (1/100000 CPU) for inf, as sc_adjust() does once admitted */
+static void set_bw(struct sc_priv_info *prv, struct sc_vcpu_info *inf, s_time_t bw)
+{
+    sc_vcpu_set_bw(prv, inf->vcpu, MILLISECS(100), MICROSECS(bw));
+    sc_plan_invalidate(prv);
+}
+
+/*
+ * Build the next plan and publish it, as the next global boundary would.
+ * Returns the VCPUs it moved to other CPUs.
+ */
+static int repartition(struct sc_priv_info *prv)
+{
+    struct sc_vcpu_info *inf;
+    int moved = 0;
+
+    sc_plan_build(prv);
+    EXPECT(prv->shadow->version == prv->plan_version,
+           "plan version %lu not built, shadow is %lu",
+           prv->plan_version, prv->shadow->version);
+
+    sc_plan_publish(prv);
+    list_for_each_entry ( inf, &prv->sc_list_head, sc_list )
+    {
+        moved += sc_assign_moved(&inf->assign, &inf->next_assign);
+        dp_wrap_apply(prv, inf->vcpu, &inf->next_assign);
+    }
+
+    return moved;
+}
+
+/* The CPUs in mask that are guest CPUs of plan take consecutive ranks */
+static int adjacent(struct sc_plan *plan, int first, const cpumask_t *mask)
+{
+    int cpu, r, lo = NR_CPUS, hi = -1, nr = 0;
+
+    for_each_cpu ( cpu, mask )
+    {
+        r = plan->rank[cpu];
+        if ( r < first || r >= plan->nr_cpus )
+            continue;
+        lo = min(lo, r);
+        hi = max(hi, r);
+        nr++;
+    }
+
+    return nr == 0 || hi - lo + 1 == nr;
+}
+
+static void check_fill_order(struct sc_priv_info *prv)
+{
+    struct sc_plan *plan = prv->plan;
+    int first = prv->dom0_cpu_count, r, cpu;
+
+    EXPECT(plan->nr_cpus == cpumask_weight(&prv->cpumask),
+           "fill order has %u CPUs, the instance %u",
+           plan->nr_cpus, cpumask_weight(&prv->cpumask));
+
+    for ( r = 0; r < plan->nr_cpus; r++ )
+    {
+        cpu = plan->fill[r];
+        EXPECT(plan->rank[cpu] == r, "CPU %d at rank %d has rank %d",
+               cpu, r, plan->rank[cpu]);
+        EXPECT(r >= first || cpu < first, "dom0 rank %d is guest CPU %d", r, cpu);
+        EXPECT(adjacent(plan, first, per_cpu(cpu_sibling_mask, cpu)),
+               "SMT siblings of CPU %d are not next to each other", cpu);
+        EXPECT(adjacent(plan, first, per_cpu(cpu_core_mask, cpu)),
+               "package of CPU %d is not next to each other", cpu);
+    }
+}
+
+/*
+ * The plan in use holds every admitted VCPU, no CPU is handed out beyond
+ * its hyper-period, and a split VCPU is on two neighbours in the fill
+ * order, in one package. Returns the splits.
+ */
+static int check_plan(struct sc_priv_info *prv)
+{
+    struct sc_plan *plan = prv->plan;
+    struct sc_vcpu_info *inf;
+    s_time_t load[NR_CPUS] = { 0 };
+    int cpu, a, b, splits = 0;
+
+    list_for_each_entry ( inf, &prv->sc_list_head, sc_list )
+    {
+        EXPECT(inf->assign.placed || !inf->rate, "d%dv%d admitted but not placed",
+               inf->vcpu->domain->domain_id, inf->vcpu->vcpu_id);
+        if ( !inf->assign.placed )
+            continue;
+
+        a = inf->assign.processor_a;
+        if ( !inf->assign.split )
+        {
+            load[a] += inf->next_bw;
+            continue;
+        }
+
+        b = inf->assign.processor_b;
+        load[a] += inf->assign.slice_a;
+        load[b] += inf->assign.slice_b;
+        splits++;
+
+        EXPECT(inf->assign.slice_a + inf->assign.slice_b == inf->next_bw,
+               "d%dv%d split %ld + %ld for %ld", inf->vcpu->domain->domain_id,
+               inf->vcpu->vcpu_id, inf->assign.slice_a, inf->assign.slice_b,
+               inf->next_bw);
+        EXPECT(sc_plan_next(plan, a) == b, "d%dv%d split across CPU %d and %d",
+               inf->vcpu->domain->domain_id, inf->vcpu->vcpu_id, a, b);
+        EXPECT(cpumask_test_cpu(b, per_cpu(cpu_core_mask, a)),
+               "d%dv%d split across packages, CPU %d and %d",
+               inf->vcpu->domain->domain_id, inf->vcpu->vcpu_id, a, b);
+    }
+
+    for_each_cpu ( cpu, &prv->cpumask )
+        EXPECT(load[cpu] <= 100000, "CPU %d handed out %ld", cpu, load[cpu]);
+
+    return splits;
+}
+
+/* The VCPUs bandwidths are changed for, and what they add up to */
+static struct sc_vcpu_info **vcpus;
+static int nr_check_vcpus;
+static s_time_t budget, total, bw_lo;
+
+/*
+ * Give every VCPU the same bandwidth, 90% of the budget between them, and
+ * partition the CPUs for that. The budget is CHECK_MAX_BW short of the
+ * capacity once per package: the most keeping splits in their package can
+ * leave unused, as only the last CPU of a package can be left with room a
+ * VCPU did not fit in.
+ */
+static void load(struct sc_priv_info *prv)
+{
+    struct sc_vcpu_info *inf;
+    s_time_t bw;
+    int nr = 0, i;
+
+    vcpus = xzalloc_array(struct sc_vcpu_info *, prv->nr_vcpus);
+    BUG_ON(vcpus == NULL);
+    list_for_each_entry ( inf, &prv->sc_list_head, sc_list )
+        vcpus[nr++] = inf;
+    nr_check_vcpus = nr;
+
+    budget = sc_capacity(prv) - nr_llcs * CHECK_MAX_BW;
+    BUG_ON(budget < nr);
+    bw_lo = min(budget / nr / 2, (s_time_t)CHECK_MAX_BW);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        bw = min((s_time_t)CHECK_MAX_BW, budget * 9 / 10 / nr);
+        set_bw(prv, vcpus[i], bw);
+        total += bw;
+    }
+    repartition(prv);
+}
+
+/*
+ * Stage a random bandwidth for inf and return the one it had. They are
+ * drawn large enough to keep the total against the budget, so the plan is
+ * tight and now and then gets rebuilt from scratch.
+ */
+static s_time_t restage(struct sc_priv_info *prv, struct sc_vcpu_info *inf)
+{
+    s_time_t old = inf->bw, bw;
+
+    total -= old;
+    bw = bw_lo + rng_next() % (CHECK_MAX_BW - bw_lo + 1);
+    bw = min(bw, budget - total);
+    set_bw(prv, inf, bw);
+    total += bw;
+
+    return old;
+}
+
+/* Stage a random bandwidth for k random VCPUs */
+static void change(struct sc_priv_info *prv, int k)
+{
+    while ( k-- > 0 )
+        restage(prv, vcpus[rng_next() % nr_check_vcpus]);
+}
+
+/*
+ * Random bandwidths for rounds repartitions, a few VCPUs at a time and
+ * every sixteenth round nearly all of them.
+ */
+static void check_topology(struct sc_priv_info *prv, int rounds)
+{
+    int splits;
+
+    check_fill_order(prv);
+    splits = check_plan(prv);
+
+    while ( rounds-- > 0 )
+    {
+        change(prv, rounds % 16 ? 1 + rng_next() % 8 : nr_check_vcpus);
+        repartition(prv);
+        splits += check_plan(prv);
+    }
+
+    printf("topology_splits    %d\n", splits);
+}
+
+/* a and b put a VCPU on the same CPUs, with the same split */
+static int same_place(const struct sc_assignment *a, const struct sc_assignment *b)
+{
+    if ( a->placed != b->placed || !a->placed )
+        return a->placed == b->placed;
+
+    return (a->processor_a == b->processor_a && a->split == b->split &&
+            (!a->split || (a->processor_b == b->processor_b &&
+                           a->slice_a == b->slice_a && a->slice_b == b->slice_b)));
+}
+
+/*
+ * What sc_plan_build() should make of the bandwidths staged, worked out the
+ * plain way: the CPUs ranked before plan_from and the VCPUs that start on
+ * them are kept, every other VCPU of sc_list_head tries to stay, split ones
+ * last, what is left goes through dp_wrap_fill(), and if that fails the
+ * whole plan is rebuilt. Unlike sc_plan_build() this walks the whole list
+ * and relies on nothing but the plan in use. order[] gets the list, want[]
+ * the place of each. Returns the VCPUs on the list.
+ */
+static int model_build(struct sc_priv_info *prv, struct sc_plan *plan,
+                       struct sc_vcpu_info **order, struct sc_assignment *want)
+{
+    struct sc_plan *live = prv->plan;
+    struct sc_vcpu_info *inf;
+    unsigned char *kept;
+    int first = prv->dom0_cpu_count, from = max(prv->plan_from, first);
+    int nr = 0, i, r, cpu, split, wrap;
+
+    kept = xzalloc_array(unsigned char, prv->nr_vcpus);
+    BUG_ON(kept == NULL);
+
+    memcpy(plan->fill, live->fill, sizeof(plan->fill));
+    memcpy(plan->rank, live->rank, sizeof(plan->rank));
+    plan->nr_cpus = live->nr_cpus;
+    plan->full = prv->full_slack;
+    plan->overhead = sc_plan_overhead(prv);
+    if ( plan->overhead != live->overhead )
+        from = first;
+
+    for ( r = 0; r < plan->nr_cpus; r++ )
+    {
+        cpu = plan->fill[r];
+        if ( r < from )
+            sc_plan_set(plan, cpu, HSLICE(live, cpu), HPERIOD(live, cpu));
+        else
+            sc_plan_set(plan, cpu, 0, 100000);
+    }
+    for ( r = 0; r < from; r++ )
+        cpumask_clear_cpu(r, &plan->room);
+
+    list_for_each_entry ( inf, &prv->sc_list_head, sc_list )
+    {
+        order[nr] = inf;
+        want[nr] = inf->assign;
+        if ( !inf->rate )
+            want[nr].placed = 0;
+
+        kept[nr] = (inf->assign.placed && plan->rank[inf->assign.processor_a] < from);
+        cpu = inf->assign.processor_b;
+        if ( kept[nr] && inf->assign.split && plan->rank[cpu] == from )
+            sc_plan_set(plan, cpu, HSLICE(plan, cpu) + inf->assign.slice_b,
+                        HPERIOD(plan, cpu));
+        nr++;
+    }
+
+    for ( split = 0; split < 2; split++ )
+        for ( i = 0; i < nr; i++ )
+            if ( !kept[i] && order[i]->assign.split == split &&
+                 !dp_wrap_stay(plan, sc_plan_bw(plan, order[i]->bw), &want[i]) )
+                want[i].placed = 0;
+
+    for ( i = 0; i < nr; i++ )
+        if ( !kept[i] && !want[i].placed && order[i]->rate &&
+             !dp_wrap_fill(plan, sc_plan_bw(plan, order[i]->bw), &want[i]) )
+            break;
+
+    if ( i < nr )
+    {
+        for ( i = 0; i < nr; i++ )
+        {
+            want[i] = order[i]->assign;
+            want[i].placed = 0;
+        }
+
+        for ( wrap = 0; wrap < 2; wrap++ )
+        {
+            for ( r = first; r < plan->nr_cpus; r++ )
+                sc_plan_set(plan, plan->fill[r], 0, 100000);
+
+            for ( i = 0; i < nr; i++ )
+            {
+                if ( !order[i]->rate )
+                    continue;
+
+                if ( wrap )
+                    dp_wrap_place(plan, sc_plan_bw(plan, order[i]->bw), 100000, &want[i]);
+                else if ( !dp_wrap_fill(plan, sc_plan_bw(plan, order[i]->bw), &want[i]) )
+                    break;
+            }
+
+            if ( i == nr )
+                break;
+        }
+    }
+
+    xfree(kept);
+    return nr;
+}
+
+/*
+ * Each round stages a few changes and builds the next plan the way the
+ * plan tasklet does, from plan_from on. That has to come out as the model
+ * says, CPU by CPU and VCPU by VCPU, and leave the VCPUs on the CPUs kept
+ * at the head of sc_list_head, which the next build relies on.
+ */
+static void check_incremental(struct sc_priv_info *prv, int rounds)
+{
+    static struct sc_plan model;
+    struct sc_vcpu_info **order, *inf;
+    struct sc_assignment *want;
+    unsigned long rebuilt = 0;
+    int nr, i, r, cpu, head, n = rounds;
+
+    order = xzalloc_array(struct sc_vcpu_info *, prv->nr_vcpus);
+    want = xzalloc_array(struct sc_assignment, prv->nr_vcpus);
+    BUG_ON(order == NULL || want == NULL);
+
+    while ( rounds-- > 0 )
+    {
+        change(prv, rounds % 16 ? 1 + rng_next() % 3 : nr_check_vcpus);
+
+        r = max(prv->plan_from, prv->dom0_cpu_count);
+        rebuilt += prv->plan->nr_cpus - min(r, (int)prv->plan->nr_cpus);
+
+        nr = model_build(prv, &model, order, want);
+        sc_plan_build(prv);
+        EXPECT(prv->shadow->version == prv->plan_version,
+               "plan version %lu not built, shadow is %lu",
+               prv->plan_version, prv->shadow->version);
+
+        for ( r = prv->dom0_cpu_count; r < model.nr_cpus; r++ )
+        {
+            cpu = model.fill[r];
+            EXPECT(HSLICE(prv->shadow, cpu) == HSLICE(&model, cpu),
+                   "CPU %d has %llu of the next plan, the model %llu", cpu,
+                   HSLICE(prv->shadow, cpu), HSLICE(&model, cpu));
+        }
+
+        for ( i = 0; i < nr; i++ )
+            EXPECT(same_place(&order[i]->next_assign, &want[i]),
+                   "d%dv%d placed on CPU %d/%d, the model on %d/%d",
+                   order[i]->vcpu->domain->domain_id, order[i]->vcpu->vcpu_id,
+                   order[i]->next_assign.processor_a,
+                   order[i]->next_assign.split ? order[i]->next_assign.processor_b : -1,
+                   want[i].processor_a, want[i].split ? want[i].processor_b : -1);
+
+        head = 1;
+        list_for_each_entry ( inf, &prv->sc_list_head, sc_list )
+        {
+            if ( inf->assign.placed &&
+                 prv->plan->rank[inf->assign.processor_a] < prv->plan_from )
+                EXPECT(head, "d%dv%d kept after a VCPU placed again",
+                       inf->vcpu->domain->domain_id, inf->vcpu->vcpu_id);
+            else
+                head = 0;
+        }
+
+        repartition(prv);
+        check_plan(prv);
+    }
+
+    printf("incremental_cpus   %.1f per round\n", n ? (double)rebuilt / n : 0.0);
+    xfree(want);
+    xfree(order);
+}
+
+/*
+ * VCPUs placing every one of them again from scratch, as a repartition
+ * used to, would move from where the plan in use has them.
+ */
+static int scratch_moved(struct sc_priv_info *prv)
+{
+    static struct sc_plan plan;
+    struct sc_plan *live = prv->plan;
+    struct sc_vcpu_info *inf;
+    struct sc_assignment a;
+    int r, cpu, moved = 0;
+
+    memcpy(plan.fill, live->fill, sizeof(plan.fill));
+    memcpy(plan.rank, live->rank, sizeof(plan.rank));
+    plan.nr_cpus = live->nr_cpus;
+    plan.full = prv->full_slack;
+    plan.overhead = live->overhead;
+
+    for ( r = 0; r < plan.nr_cpus; r++ )
+    {
+        cpu = plan.fill[r];
+        if ( r < prv->dom0_cpu_count )
+        {
+            sc_plan_set(&plan, cpu, HSLICE(live, cpu), HPERIOD(live, cpu));
+            cpumask_clear_cpu(r, &plan.room);
+        }
+        else
+            sc_plan_set(&plan, cpu, 0, 100000);
+    }
+
+    list_for_each_entry ( inf, &prv->sc_list_head, sc_list )
+    {
+        a = inf->assign;
+        a.placed = 0;
+        if ( inf->rate )
+            dp_wrap_place(&plan, sc_plan_bw(&plan, inf->bw), 100000, &a);
+        moved += sc_assign_moved(&inf->assign, &a);
+    }
+
+    return moved;
+}
+
+/* Every CPU new has a VCPU on, old had it on too */
+static int within(const struct sc_assignment *old, const struct sc_assignment *new)
+{
+    if ( !new->placed )
+        return !old->placed;
+
+    return ((new->processor_a == old->processor_a ||
+             (old->split && new->processor_a == old->processor_b)) &&
+            (!new->split || new->processor_b == old->processor_a ||
+             (old->split && new->processor_b == old->processor_b)));
+}
+
+/*
+ * One VCPU changes per round. One that only gives bandwidth back sends no
+ * VCPU to a CPU it was not on, as everything still fits where it was; a
+ * split VCPU may end up on its first CPU only. Over all the rounds far
+ * fewer VCPUs move than placing them all from scratch would.
+ */
+static void check_stability(struct sc_priv_info *prv, int rounds)
+{
+    struct sc_vcpu_info *inf;
+    struct sc_assignment *was;
+    unsigned long moved = 0, scratch = 0;
+    int n = rounds, i;
+    s_time_t old;
+
+    was = xzalloc_array(struct sc_assignment, nr_check_vcpus);
+    BUG_ON(was == NULL);
+
+    while ( rounds-- > 0 )
+    {
+        inf = vcpus[rng_next() % nr_check_vcpus];
+        old = restage(prv, inf);
+
+        for ( i = 0; i < nr_check_vcpus; i++ )
+            was[i] = vcpus[i]->assign;
+        scratch += scratch_moved(prv);
+        moved += repartition(prv);
+        check_plan(prv);
+
+        if ( inf->bw > old )
+            continue;
+
+        for ( i = 0; i < nr_check_vcpus; i++ )
+            EXPECT(within(&was[i], &vcpus[i]->assign),
+                   "d%dv%d shrank from %ld to %ld and moved d%dv%d",
+                   inf->vcpu->domain->domain_id, inf->vcpu->vcpu_id, old, inf->bw,
+                   vcpus[i]->vcpu->domain->domain_id, vcpus[i]->vcpu->vcpu_id);
+    }
+
+    xfree(was);
+    if ( n == 0 )
+        return;
+
+    printf("stability_moved    %.2f per change, %.2f from scratch\n",
+           (double)moved / n, (double)scratch / n);
+    EXPECT(moved * 4 <= scratch, "repartitions moved %lu VCPUs, placing from scratch %lu",
+           moved, scratch);
+}
+
+/* Batch entry giving VCPU vcpuid of the domain bw (1/100000 CPU) */
+static void entry(xen_domctl_schedparam_vcpu_t *e, uint32_t vcpuid, s_time_t bw)
+{
+    memset(e, 0, sizeof(*e));
+    e->vcpuid = vcpuid;
+    e->u.sc.period = MILLISECS(100);
+    e->u.sc.slice = MICROSECS(bw);
+    /* Only ever 0 or an errno once the batch is back */
+    e->status = 1;
+}
+
+/* XEN_DOMCTL_SCHEDOP_putvcpuinfo for the domain, as the guest's hypercall */
+static int put_batch(xen_domctl_schedparam_vcpu_t *e, int nr, uint32_t *left)
+{
+    struct xen_domctl_scheduler_op op;
+    int rc;
+
+    memset(&op, 0, sizeof(op));
+    op.sched_id = XEN_SCHEDULER_SC;
+    op.cmd = XEN_DOMCTL_SCHEDOP_putvcpuinfo;
+    set_xen_guest_handle(op.u.v.vcpus, e);
+    op.u.v.nr_vcpus = nr;
+
+    rc = ops.adjust(&ops, &check_domain, &op);
+    if ( left != NULL )
+        *left = op.u.v.left;
+    return rc;
+}
+
+/*
+ * The batched putvcpuinfo: an entry with bad parameters, for a VCPU the
+ * domain does not have, or for one given twice, comes back saying so and
+ * holds the whole batch back. A batch that does not fit as a whole comes
+ * back with -ENOSPC on every entry and what would have fitted in left, and
+ * a batch of exactly that is let in. Nothing changes for a batch refused;
+ * one let in is taken in as a whole and repartitioned for once.
+ */
+static void check_batch(struct sc_priv_info *prv)
+{
+    xen_domctl_schedparam_vcpu_t *e;
+    unsigned long version = prv->plan_version;
+    s_time_t admitted = prv->bw_admitted, release = 0, bw;
+    uint32_t left = 0;
+    int nr = nr_check_vcpus, rc, i;
+
+    e = xzalloc_array(xen_domctl_schedparam_vcpu_t, nr);
+    BUG_ON(e == NULL || nr < 2);
+
+    entry(&e[0], 0, 1000);
+    entry(&e[1], 1, 1000);
+    e[1].u.sc.slice = e[1].u.sc.period + 1;
+    entry(&e[2], check_domain.max_vcpus, 1000);
+    entry(&e[3], 0, 2000);
+    rc = put_batch(e, 4, NULL);
+    EXPECT(rc == -EINVAL, "bad batch returned %d", rc);
+    EXPECT(e[0].status == 0, "good entry came back with %d", e[0].status);
+    EXPECT(e[1].status == -EINVAL, "bad parameters came back with %d", e[1].status);
+    EXPECT(e[2].status == -ESRCH, "missing VCPU came back with %d", e[2].status);
+    EXPECT(e[3].status == -EINVAL, "duplicate entry came back with %d", e[3].status);
+    EXPECT(prv->plan_version == version && prv->bw_admitted == admitted,
+           "bad batch changed the admitted bandwidth from %ld to %ld",
+           admitted, prv->bw_admitted);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        entry(&e[i], i, 100000);
+        release += EDOM_INFO(check_domain.vcpu[i])->bw;
+    }
+    rc = put_batch(e, nr, &left);
+    EXPECT(rc == -ENOSPC, "oversized batch returned %d", rc);
+    for ( i = 0; i < nr; i++ )
+        EXPECT(e[i].status == -ENOSPC, "entry %d of an oversized batch came back with %d",
+               i, e[i].status);
+    EXPECT(left >= release && left < (s_time_t)nr * 100000,
+           "oversized batch left %u, releasing %ld", left, release);
+    EXPECT(prv->plan_version == version && prv->bw_admitted == admitted,
+           "oversized batch changed the admitted bandwidth from %ld to %ld",
+           admitted, prv->bw_admitted);
+
+    for ( i = 0; i < nr; i++ )
+        entry(&e[i], i, left / nr + (i < left % nr));
+    rc = put_batch(e, nr, NULL);
+    EXPECT(rc == 0, "batch of the %u left returned %d", left, rc);
+    EXPECT(prv->bw_admitted == admitted - release + left,
+           "batch of the %u left admitted %ld", left, prv->bw_admitted - admitted + release);
+
+    /* Back within the budget, for a plan that keeps splits in packages */
+    bw = min((s_time_t)CHECK_MAX_BW, budget * 9 / 10 / nr);
+    for ( i = 0; i < nr; i++ )
+        entry(&e[i], i, bw);
+    rc = put_batch(e, nr, NULL);
+    EXPECT(rc == 0, "batch within the budget returned %d", rc);
+    for ( i = 0; i < nr; i++ )
+        EXPECT(e[i].status == 0, "entry %d came back with %d", i, e[i].status);
+    EXPECT(prv->status & SC_SHIFT, "batch let in asked for no repartition");
+    total = prv->bw_admitted;
+
+    sim_run_tasklets();
+    EXPECT(prv->shadow->version == prv->plan_version,
+           "plan tasklet left version %lu unbuilt", prv->plan_version);
+    repartition(prv);
+    check_plan(prv);
+    for ( i = 0; i < nr; i++ )
+        EXPECT(EDOM_INFO(check_domain.vcpu[i])->bw == bw &&
+               EDOM_INFO(check_domain.vcpu[i])->next_bw == sc_plan_bw(prv->plan, bw),
+               "d%dv%d has %ld after a batch of %ld", check_domain.domain_id, i,
+               EDOM_INFO(check_domain.vcpu[i])->bw, bw);
+
+    xfree(e);
+}
+
+int main(int argc, char **argv)
+{
+    int nr_vcpus = 96, nr_cpus = 32, threads = 2, rounds = 2000, opt;
+
+    while ( (opt = getopt(argc, argv, "c:L:H:n:r:s:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'c': nr_cpus = atoi(optarg); break;
+        case 'L': nr_llcs = atoi(optarg); break;
+        case 'H': threads = atoi(optarg); break;
+        case 'n': nr_vcpus = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-c cpus] [-L llcs] [-H threads] [-n vcpus]\n"
+                    "          [-r rounds] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if ( nr_vcpus < 1 || rounds < 0 || nr_llcs < 1 || threads < 1 ||
+         nr_cpus < 2 || nr_cpus > NR_CPUS || nr_cpus % threads )
+        return 1;
+
+    setup(nr_vcpus, nr_cpus, threads);
+    printf("vcpus              %d\n", nr_vcpus);
+    printf("pcpus              %d (%d llcs, %d threads per core)\n",
+           nr_cpus, nr_llcs, threads);
+
+    load(SC_PRIV(&ops));
+    check_topology(SC_PRIV(&ops), rounds);
+    check_incremental(SC_PRIV(&ops), rounds);
+    check_stability(SC_PRIV(&ops), rounds);
+    check_batch(SC_PRIV(&ops));
+
+    printf("failures           %lu\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,581 @@
+/******************************************************************************
+ * Discrete-event simulator for the RTVirt DP-Wrap scheduler
+ *
+ * Builds sched_rtvirt.c unmodified against the Xen shim in include/ and
+ * replays a synthetic periodic/sporadic VCPU workload on N simulated pCPUs.
+ * Scheduling decisions are fully deterministic for a given seed; only the
+ * reported wall-clock cost of sc_do_schedule depends on the host.
+ *
+ * Usage: rtvirt-sim [-c cpus] [-L llcs] [-H threads] [-n vcpus] [-u util]
+ *                   [-S sporadic-ratio] [-o switch-ns] [-C] [-d duration-ms]
+ *                   [-s seed] [-p] [-v]
+ *
+ * -o makes every context switch take that long: the VCPU switched to only
+ * starts running, and the one switched from is only saved (context_saved),
+ * once it is over. -C has the scheduler calibrate its timing constants
+ * through sysctl at the start of the run.
+ ******************************************************************************/
+
+#include <time.h>
+#include <unistd.h>
+#include <xen/sim-shim.h>
+#include "sim.h"
+
+extern const struct scheduler sched_sc_def;
+
+#define SIM_MAX_DOMUS       1024
+#define SIM_SOFTIRQ_ROUNDS  64
+
+struct sim_job {
+    s_time_t period;
+    s_time_t slice;
+    int      sporadic;
+    int      admitted;
+
+    s_time_t next_release;
+    s_time_t deadline;
+    s_time_t remaining;
+    int      last_cpu;
+
+    unsigned long released;
+    unsigned long completed;
+    unsigned long missed;
+    s_time_t      max_lateness;
+};
+
+static struct scheduler ops;
+static struct domain idle_domain, *dom0;
+static struct domain *domus[SIM_MAX_DOMUS];
+static struct sim_job jobs[SIM_MAX_DOMUS];
+static int nr_domus;
+
+static s_time_t timer_expiry[NR_CPUS];
+
+static s_time_t switch_cost;
+static s_time_t switch_done[NR_CPUS];
+static struct vcpu *switch_prev[NR_CPUS];
+
+static struct {
+    unsigned long sched_calls;
+    unsigned long ctx_switches;
+    unsigned long migrations;
+    unsigned long llc_migrations;
+    unsigned long busy_conflicts;
+    uint64_t      sched_ns_sum;
+    uint64_t      sched_ns_max;
+} stats;
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double rng_unit(void)
+{
+    return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t host_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct vcpu *alloc_sim_vcpu(struct domain *d, int vcpu_id, int cpu)
+{
+    struct vcpu *v = xzalloc(struct vcpu);
+
+    BUG_ON(v == NULL);
+    v->vcpu_id = vcpu_id;
+    v->processor = cpu;
+    v->domain = d;
+    d->vcpu[vcpu_id] = v;
+    if ( vcpu_id > 0 )
+        d->vcpu[vcpu_id - 1]->next_in_list = v;
+
+    v->sched_priv = ops.alloc_vdata(&ops, v, d->sched_priv);
+    BUG_ON(v->sched_priv == NULL);
+    ops.insert_vcpu(&ops, v);
+
+    return v;
+}
+
+static struct domain *alloc_sim_domain(domid_t domid, unsigned int nr_vcpus)
+{
+    struct domain *d = xzalloc(struct domain);
+
+    BUG_ON(d == NULL);
+    d->domain_id = domid;
+    d->max_vcpus = nr_vcpus;
+    d->vcpu = xzalloc_array(struct vcpu *, nr_vcpus);
+    d->shared_info = xzalloc(struct shared_info);
+    BUG_ON(d->vcpu == NULL || d->shared_info == NULL);
+    BUG_ON(ops.init_domain(&ops, d));
+
+    return d;
+}
+
+static int set_params(struct domain *d, s_time_t period, s_time_t slice)
+{
+    struct xen_domctl_scheduler_op op;
+
+    memset(&op, 0, sizeof(op));
+    op.sched_id = ops.sched_id;
+    op.cmd = XEN_DOMCTL_SCHEDOP_putinfo;
+    op.u.sc.period = period;
+    op.u.sc.slice = slice;
+    op.u.sc.weight = 1;
+    op.u.sc.extratime = 0;
+
+    sim_cpu = 0;
+    return ops.adjust(&ops, d, &op);
+}
+
+/* Read the timing constants, or set them if put */
+static void timing(struct xen_sysctl_sched_sc *sc, int put)
+{
+    struct xen_sysctl_scheduler_op op;
+
+    memset(&op, 0, sizeof(op));
+    op.sched_id = ops.sched_id;
+    op.cmd = put ? XEN_SYSCTL_SCHEDOP_putinfo : XEN_SYSCTL_SCHEDOP_getinfo;
+    if ( put )
+        op.u.sc = *sc;
+
+    sim_cpu = 0;
+    BUG_ON(ops.adjust_global(&ops, &op));
+    *sc = op.u.sc;
+}
+
+static void sim_wake(struct vcpu *v)
+{
+    v->sim_runnable = 1;
+    sim_cpu = v->processor;
+    ops.wake(&ops, v);
+}
+
+/* The switch on cpu is over: prev is off it and can be saved */
+static void finish_switch(int cpu)
+{
+    struct vcpu *prev = switch_prev[cpu];
+
+    switch_prev[cpu] = NULL;
+    prev->is_running = 0;
+
+    if ( ops.context_saved )
+    {
+        sim_cpu = cpu;
+        ops.context_saved(&ops, prev);
+    }
+}
+
+static void sim_schedule(int cpu)
+{
+    struct vcpu *prev = per_cpu(schedule_data, cpu).curr, *next;
+    struct task_slice slice;
+    uint64_t t0, t1;
+
+    /* Xen cannot schedule again before the last switch is done either */
+    if ( switch_prev[cpu] )
+        finish_switch(cpu);
+
+    sim_cpu = cpu;
+    t0 = host_ns();
+    slice = ops.do_schedule(&ops, sim_now, 0);
+    t1 = host_ns();
+
+    stats.sched_calls++;
+    stats.sched_ns_sum += t1 - t0;
+    if ( t1 - t0 > stats.sched_ns_max )
+        stats.sched_ns_max = t1 - t0;
+
+    next = slice.task;
+
+    /* Xen would BUG here; count it and fall back to idle instead. */
+    if ( next != prev && next->is_running )
+    {
+        stats.busy_conflicts++;
+        next = idle_vcpu[cpu];
+    }
+
+    timer_expiry[cpu] = (slice.time >= 0) ? sim_now + slice.time : -1;
+
+    if ( next == prev )
+        return;
+
+    stats.ctx_switches++;
+    TRACE_4D(TRC_SCHED_SWITCH,
+             prev->domain->domain_id, prev->vcpu_id,
+             next->domain->domain_id, next->vcpu_id);
+    per_cpu(schedule_data, cpu).curr = next;
+    next->is_running = 1;
+
+    switch_prev[cpu] = prev;
+    switch_done[cpu] = sim_now + switch_cost;
+    if ( !switch_cost )
+        finish_switch(cpu);
+
+    if ( !is_idle_vcpu(next) && next->domain->domain_id != 0 )
+    {
+        struct sim_job *j = &jobs[next->domain->domain_id - 1];
+
+        if ( j->last_cpu >= 0 && j->last_cpu != cpu )
+        {
+            stats.migrations++;
+            if ( !cpumask_test_cpu(cpu, per_cpu(cpu_core_mask, j->last_cpu)) )
+                stats.llc_migrations++;
+        }
+        j->last_cpu = cpu;
+    }
+}
+
+static void run_softirqs(void)
+{
+    int round, cpu, pending;
+
+    for ( round = 0; round < SIM_SOFTIRQ_ROUNDS; round++ )
+    {
+        pending = 0;
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        {
+            if ( !sim_softirq_pending[cpu] )
+                continue;
+            sim_softirq_pending[cpu] = 0;
+            sim_schedule(cpu);
+            pending = 1;
+        }
+        if ( !pending )
+            break;
+    }
+
+    sim_run_tasklets();
+}
+
+static struct sim_job *running_job(int cpu, struct vcpu **pv)
+{
+    struct vcpu *v = per_cpu(schedule_data, cpu).curr;
+
+    if ( switch_prev[cpu] || is_idle_vcpu(v) || v->domain->domain_id == 0 )
+        return NULL;
+    if ( pv )
+        *pv = v;
+    return &jobs[v->domain->domain_id - 1];
+}
+
+static void release_job(int i)
+{
+    struct sim_job *j = &jobs[i];
+    struct vcpu *v = domus[i]->vcpu[0];
+
+    if ( j->remaining > 0 )
+    {
+        /* Previous job overran into this release: it missed. */
+        j->missed++;
+        if ( sim_now - j->deadline > j->max_lateness )
+            j->max_lateness = sim_now - j->deadline;
+    }
+
+    j->released++;
+    j->remaining = j->slice;
+    j->deadline = sim_now + j->period;
+    j->next_release = sim_now + j->period;
+    if ( j->sporadic )
+        j->next_release += (s_time_t)(rng_unit() * (j->period / 2));
+
+    if ( !v->sim_runnable )
+        sim_wake(v);
+}
+
+static void complete_job(int cpu, struct vcpu *v, struct sim_job *j)
+{
+    j->completed++;
+    if ( sim_now > j->deadline )
+    {
+        j->missed++;
+        if ( sim_now - j->deadline > j->max_lateness )
+            j->max_lateness = sim_now - j->deadline;
+    }
+
+    /* vcpu_block(): mark blocked and let the scheduler notice. */
+    v->sim_runnable = 0;
+    sim_cpu = cpu;
+    sim_raise_softirq(cpu);
+}
+
+static void setup(int nr_cpus, int nr_vcpus, double util, double sporadic)
+{
+    static const int periods_ms[] = { 10, 20, 25, 40, 50, 100 };
+    double left = util * (nr_cpus - 1);
+    int cpu, i;
+
+    nr_cpu_ids = nr_cpus;
+    for ( cpu = 0; cpu < nr_cpus; cpu++ )
+        cpumask_set_cpu(cpu, &cpu_online_map);
+
+    ops = sched_sc_def;
+    BUG_ON(ops.init(&ops));
+
+    idle_domain.domain_id = DOMID_IDLE;
+    idle_domain.vcpu = idle_vcpu;
+    idle_domain.max_vcpus = nr_cpus;
+
+    for ( cpu = 0; cpu < nr_cpus; cpu++ )
+    {
+        struct schedule_data *sd = &per_cpu(schedule_data, cpu);
+
+        spin_lock_init(&sd->_lock);
+        sd->schedule_lock = &sd->_lock;
+        sd->sched_priv = ops.alloc_pdata(&ops, cpu);
+        sim_cpu = cpu;
+        sd->curr = alloc_sim_vcpu(&idle_domain, cpu, cpu);
+        sd->curr->is_running = 1;
+        sd->curr->sim_runnable = 1;
+        timer_expiry[cpu] = -1;
+    }
+
+    /* Dom0 owns CPU 0 and stays blocked for the whole run. */
+    sim_cpu = 0;
+    dom0 = alloc_sim_domain(0, 1);
+    alloc_sim_vcpu(dom0, 0, 0);
+
+    for ( i = 0; i < nr_vcpus; i++ )
+    {
+        struct sim_job *j = &jobs[i];
+        double u = left / (nr_vcpus - i);
+
+        /* Spread the remaining bandwidth with some jitter. */
+        u *= 0.5 + rng_unit();
+        if ( u > 0.9 )
+            u = 0.9;
+        if ( u > left )
+            u = left;
+        left -= u;
+
+        j->period = MILLISECS(periods_ms[rng_next() % ARRAY_SIZE(periods_ms)]);
+        j->slice = (s_time_t)(u * j->period) / 1000 * 1000;
+        if ( j->slice < MICROSECS(5) )
+            j->slice = MICROSECS(5);
+        j->sporadic = rng_unit() < sporadic;
+        j->last_cpu = -1;
+        j->next_release = MILLISECS(1) + (s_time_t)(rng_unit() * MILLISECS(1));
+
+        domus[i] = alloc_sim_domain(i + 1, 1);
+        alloc_sim_vcpu(domus[i], 0, 0);
+
+        /* Same sequence an RT guest uses: default first, then adjust. */
+        set_params(domus[i], j->period, j->slice);
+        j->admitted = !set_params(domus[i], j->period, j->slice);
+    }
+    nr_domus = nr_vcpus;
+}
+
+static void run(s_time_t end)
+{
+    s_time_t next, dt;
+    struct sim_job *j;
+    struct vcpu *v;
+    int cpu, i;
+
+    /* Every pCPU goes through schedule() once at boot. */
+    for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+    {
+        sim_cpu = cpu;
+        sim_raise_softirq(cpu);
+    }
+    run_softirqs();
+
+    while ( sim_now < end )
+    {
+        next = end;
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        {
+            if ( timer_expiry[cpu] >= 0 && timer_expiry[cpu] < next )
+                next = timer_expiry[cpu];
+            if ( switch_prev[cpu] && switch_done[cpu] < next )
+                next = switch_done[cpu];
+            if ( (j = running_job(cpu, NULL)) && j->remaining > 0 &&
+                 sim_now + j->remaining < next )
+                next = sim_now + j->remaining;
+        }
+        for ( i = 0; i < nr_domus; i++ )
+            if ( jobs[i].next_release < next )
+                next = jobs[i].next_release;
+
+        if ( next < sim_now )
+            next = sim_now;
+        dt = next - sim_now;
+
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+            if ( (j = running_job(cpu, NULL)) && j->remaining > 0 )
+                j->remaining -= (dt < j->remaining) ? dt : j->remaining;
+
+        sim_now = next;
+
+        for ( cpu = 0; cpu < nr_cpu_ids; cpu++ )
+        {
+            if ( switch_prev[cpu] && switch_done[cpu] <= sim_now )
+                finish_switch(cpu);
+            if ( (j = running_job(cpu, &v)) && j->remaining == 0 &&
+                 v->sim_runnable )
+                complete_job(cpu, v, j);
+            if ( timer_expiry[cpu] >= 0 && timer_expiry[cpu] <= sim_now )
+            {
+                timer_expiry[cpu] = -1;
+                sim_cpu = cpu;
+                sim_raise_softirq(cpu);
+            }
+        }
+
+        for ( i = 0; i < nr_domus; i++ )
+            if ( jobs[i].next_release <= sim_now )
+                release_job(i);
+
+        run_softirqs();
+    }
+}
+
+/*
+ * Returns how many admitted VCPUs had jobs released but never completed
+ * one. starved_vcpus also counts the ones admission refused, which never
+ * get a place; refused_vcpus says how many those are.
+ */
+static int report(int per_vcpu)
+{
+    unsigned long released = 0, completed = 0, missed = 0;
+    int starved = 0, refused = 0, lost = 0;
+    struct xen_sysctl_sched_sc sc;
+    int i;
+
+    for ( i = 0; i < nr_domus; i++ )
+    {
+        released += jobs[i].released;
+        completed += jobs[i].completed;
+        missed += jobs[i].missed;
+        refused += !jobs[i].admitted;
+        if ( jobs[i].released && !jobs[i].completed )
+        {
+            starved++;
+            lost += jobs[i].admitted;
+        }
+    }
+
+    printf("simulated_ns       %"PRIi64"\n", sim_now);
+    printf("pcpus              %u\n", nr_cpu_ids);
+    printf("vcpus              %d\n", nr_domus);
+    printf("jobs_released      %lu\n", released);
+    printf("jobs_completed     %lu\n", completed);
+    printf("deadline_misses    %lu\n", missed);
+    printf("starved_vcpus      %d\n", starved);
+    printf("refused_vcpus      %d\n", refused);
+    printf("context_switches   %lu\n", stats.ctx_switches);
+    printf("migrations         %lu\n", stats.migrations);
+    printf("llc_migrations     %lu\n", stats.llc_migrations);
+    printf("busy_conflicts     %lu\n", stats.busy_conflicts);
+    printf("ipis               %lu\n", sim_ipis);
+    printf("virqs              %lu\n", sim_virqs);
+    printf("sched_calls        %lu\n", stats.sched_calls);
+    printf("sched_ns_avg       %"PRIu64"\n",
+           stats.sched_calls ? stats.sched_ns_sum / stats.sched_calls : 0);
+    printf("sched_ns_max       %"PRIu64"\n", stats.sched_ns_max);
+
+    timing(&sc, 0);
+    printf("min_global_slice   %"PRIu64"\n", sc.min_global_slice);
+    printf("shift_delay        %"PRIu64"\n", sc.shift_delay);
+    printf("extra_quantum      %"PRIu64"\n", sc.extra_quantum);
+    printf("full_slack         %u\n", sc.full_slack);
+
+    if ( !per_vcpu )
+        return lost;
+
+    printf("\n%6s %10s %10s %4s %8s %8s %8s %12s\n", "dom", "period",
+           "slice", "spor", "released", "done", "missed", "max_late_ns");
+    for ( i = 0; i < nr_domus; i++ )
+        printf("%6d %10"PRIi64" %10"PRIi64" %4d %8lu %8lu %8lu %12"PRIi64"\n",
+               i + 1, jobs[i].period, jobs[i].slice, jobs[i].sporadic,
+               jobs[i].released, jobs[i].completed, jobs[i].missed,
+               jobs[i].max_lateness);
+
+    return lost;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-c cpus] [-L llcs] [-H threads] [-n vcpus] [-u util]\n"
+            "          [-S sporadic-ratio] [-o switch-ns] [-C] [-d duration-ms]\n"
+            "          [-s seed] [-p] [-t] [-T xentrace-file] [-v]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int nr_cpus = 4, nr_llcs = 1, nr_threads = 1, nr_vcpus = 8, per_vcpu = 0, trace = 0;
+    int calibrate = 0, opt;
+    struct xen_sysctl_sched_sc sc;
+    double util = 0.5, sporadic = 0.5;
+    s_time_t duration = MILLISECS(2000);
+
+    while ( (opt = getopt(argc, argv, "c:L:H:n:u:S:o:Cd:s:ptT:v")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'c': nr_cpus = atoi(optarg); break;
+        case 'L': nr_llcs = atoi(optarg); break;
+        case 'H': nr_threads = atoi(optarg); break;
+        case 'n': nr_vcpus = atoi(optarg); break;
+        case 'u': util = atof(optarg); break;
+        case 'S': sporadic = atof(optarg); break;
+        case 'o': switch_cost = atoll(optarg); break;
+        case 'C': calibrate = 1; break;
+        case 'd': duration = MILLISECS(atoll(optarg)); break;
+        case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+        case 'p': per_vcpu = 1; break;
+        case 't': trace = 1; break;
+        case 'T':
+            if ( sim_trace_open(optarg) )
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'v': sim_verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if ( nr_cpus < 2 || nr_cpus > NR_CPUS || nr_llcs < 1 || nr_threads < 1 ||
+         nr_cpus % nr_threads || nr_vcpus < 1 || nr_vcpus > SIM_MAX_DOMUS ||
+         util <= 0 || util > 1 || switch_cost < 0 )
+        usage(argv[0]);
+
+    sim_topology(nr_cpus, nr_llcs, nr_threads);
+    setup(nr_cpus, nr_vcpus, util, sporadic);
+
+    if ( calibrate )
+    {
+        memset(&sc, 0, sizeof(sc));
+        sc.calibrate = 1;
+        timing(&sc, 1);
+    }
+
+    /* Toggle tracing the way the toolstack does, with period 2*PERIOD_MAX */
+    if ( trace )
+        set_params(domus[0], SECONDS(20), 0);
+    run(duration);
+    if ( trace )
+    {
+        set_params(domus[0], SECONDS(20), 0);
+        run_softirqs();
+    }
+    sim_trace_close();
+
+    /* An admitted VCPU that never got to run is a scheduler bug */
+    return report(per_vcpu) ? 2 : 0;
+}
@@ -0,0 +1,362 @@
+/******************************************************************************
+ * Per-VCPU latency and budget summary of RTVirt xentrace records
+ *
+ * Reads what `xentrace -e 0x0002f000` writes on a host running sched_rtvirt.c
+ * (or what rtvirt-sim -T writes) and prints, for every guest VCPU, how much
+ * budget its local slices handed out against how long it actually ran, how
+ * often and by how much it ran out, its deadline skips and the latency from
+ * a sporadic arrival to the VCPU getting a CPU, how many VCPUs each
+ * repartition moved and how many bandwidth requests admission refused.
+ *
+ * Usage: rtvirt-trace [-m cpu-mhz] trace-file
+ *
+ * -m is the TSC frequency the host traced with; the default of 1000 reads
+ * timestamps as ns, which is what the simulator writes.
+ ******************************************************************************/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+/* From xen/include/public/trace.h */
+#define TRC_LOST_RECORDS      0x0001f001
+#define TRC_TRACE_CPU_CHANGE  0x0001f003
+#define TRC_SCHED_SWITCH      0x0002800a
+#define TRACE_EXTRA_SHIFT     28
+
+/* TRC_SCHED_CLASS_EVT(RTVIRT, n), see sched_rtvirt.c */
+#define TRC_RTVIRT(_e)        (0x00022000 | (6 << 9) | (_e))
+#define TRC_RTVIRT_BOUNDARY   TRC_RTVIRT(1)
+#define TRC_RTVIRT_SLICE      TRC_RTVIRT(2)
+#define TRC_RTVIRT_MIGRATE    TRC_RTVIRT(3)
+#define TRC_RTVIRT_SKIP       TRC_RTVIRT(4)
+#define TRC_RTVIRT_ARRIVE     TRC_RTVIRT(5)
+#define TRC_RTVIRT_EXHAUST    TRC_RTVIRT(6)
+#define TRC_RTVIRT_REPLAN     TRC_RTVIRT(7)
+#define TRC_RTVIRT_REFUSE     TRC_RTVIRT(8)
+
+#define DOMID_IDLE            32767
+#define MAX_CPUS              4096
+#define VSTAT_BUCKETS         1021
+
+struct vstat {
+    struct vstat *next;
+    uint32_t domid, vcpuid;
+
+    unsigned long slices, exhausted, skips, arrivals, latencies, migrations;
+    uint64_t budget;          /* ns of local slice handed out */
+    uint64_t ran;             /* ns on a CPU */
+    uint64_t overrun, overrun_max;
+    uint64_t skip_max;
+    uint64_t lat_sum, lat_max;
+
+    int running_on;           /* CPU it is running on, or -1 */
+    uint64_t run_start;
+    int arrival_pending;
+    uint64_t arrived;
+};
+
+static struct vstat *vstats[VSTAT_BUCKETS];
+static unsigned int nr_vstats;
+
+static struct {
+    struct vstat *curr;
+    uint64_t tsc;
+} cpus[MAX_CPUS];
+
+static unsigned long boundaries, repartitions, lost;
+static unsigned long moved, moved_max, moved_of;
+static unsigned long refused;
+static uint64_t boundary_ns;
+static uint64_t cpu_mhz = 1000;
+
+static struct vstat *vstat_get(uint32_t domid, uint32_t vcpuid)
+{
+    unsigned int b = ((domid << 8) ^ vcpuid) % VSTAT_BUCKETS;
+    struct vstat *v;
+
+    for ( v = vstats[b]; v != NULL; v = v->next )
+        if ( v->domid == domid && v->vcpuid == vcpuid )
+            return v;
+
+    v = calloc(1, sizeof(*v));
+    if ( v == NULL )
+    {
+        perror("calloc");
+        exit(1);
+    }
+    v->domid = domid;
+    v->vcpuid = vcpuid;
+    v->running_on = -1;
+    v->next = vstats[b];
+    vstats[b] = v;
+    nr_vstats++;
+
+    return v;
+}
+
+static uint64_t tsc_to_ns(uint64_t tsc)
+{
+    return tsc * 1000 / cpu_mhz;
+}
+
+static void switch_in(int cpu, uint64_t now, uint32_t domid, uint32_t vcpuid)
+{
+    struct vstat *v;
+
+    if ( domid == DOMID_IDLE )
+    {
+        cpus[cpu].curr = NULL;
+        return;
+    }
+
+    v = vstat_get(domid, vcpuid);
+    v->running_on = cpu;
+    v->run_start = now;
+    cpus[cpu].curr = v;
+
+    if ( v->arrival_pending )
+    {
+        v->lat_sum += now - v->arrived;
+        if ( now - v->arrived > v->lat_max )
+            v->lat_max = now - v->arrived;
+        v->latencies++;
+        v->arrival_pending = 0;
+    }
+}
+
+static void switch_out(int cpu, uint64_t now)
+{
+    struct vstat *v = cpus[cpu].curr;
+
+    if ( v == NULL || v->running_on != cpu )
+        return;
+
+    if ( now > v->run_start )
+        v->ran += now - v->run_start;
+    v->running_on = -1;
+    cpus[cpu].curr = NULL;
+}
+
+static void handle(int cpu, uint32_t event, uint64_t now, const uint32_t *d,
+                   unsigned int n)
+{
+    struct vstat *v;
+
+    switch ( event )
+    {
+    case TRC_SCHED_SWITCH:
+        if ( n < 4 )
+            break;
+        switch_out(cpu, now);
+        switch_in(cpu, now, d[2], d[3]);
+        break;
+
+    case TRC_RTVIRT_BOUNDARY:
+        if ( n < 4 )
+            break;
+        boundaries++;
+        boundary_ns += d[0];
+        if ( d[3] )
+            repartitions++;
+        break;
+
+    case TRC_RTVIRT_SLICE:
+        if ( n < 5 )
+            break;
+        v = vstat_get(d[0], d[1]);
+        v->slices++;
+        v->budget += d[3] + d[4];
+        break;
+
+    case TRC_RTVIRT_MIGRATE:
+        if ( n < 2 )
+            break;
+        vstat_get(d[0], d[1])->migrations++;
+        break;
+
+    case TRC_RTVIRT_SKIP:
+        if ( n < 3 )
+            break;
+        v = vstat_get(d[0], d[1]);
+        v->skips++;
+        if ( d[2] > v->skip_max )
+            v->skip_max = d[2];
+        break;
+
+    case TRC_RTVIRT_ARRIVE:
+        if ( n < 2 )
+            break;
+        v = vstat_get(d[0], d[1]);
+        v->arrivals++;
+        if ( v->running_on < 0 && !v->arrival_pending )
+        {
+            v->arrival_pending = 1;
+            v->arrived = now;
+        }
+        break;
+
+    case TRC_RTVIRT_REPLAN:
+        if ( n < 2 )
+            break;
+        moved += d[0];
+        moved_of += d[1];
+        if ( d[0] > moved_max )
+            moved_max = d[0];
+        break;
+
+    case TRC_RTVIRT_REFUSE:
+        refused++;
+        break;
+
+    case TRC_RTVIRT_EXHAUST:
+        if ( n < 3 )
+            break;
+        v = vstat_get(d[0], d[1]);
+        v->exhausted++;
+        v->overrun += d[2];
+        if ( d[2] > v->overrun_max )
+            v->overrun_max = d[2];
+        break;
+    }
+}
+
+static int read_trace(FILE *f)
+{
+    uint32_t hdr, tsc[2], d[7];
+    unsigned int n;
+    uint32_t event;
+    int cpu = 0;
+
+    while ( fread(&hdr, sizeof(hdr), 1, f) == 1 )
+    {
+        event = hdr & ((1U << TRACE_EXTRA_SHIFT) - 1);
+        n = (hdr >> TRACE_EXTRA_SHIFT) & 7;
+
+        if ( hdr >> 31 )
+        {
+            if ( fread(tsc, sizeof(tsc), 1, f) != 1 )
+                return -1;
+            cpus[cpu].tsc = ((uint64_t)tsc[1] << 32) | tsc[0];
+        }
+        if ( n && fread(d, sizeof(d[0]), n, f) != n )
+            return -1;
+
+        switch ( event )
+        {
+        case TRC_TRACE_CPU_CHANGE:
+            if ( n < 1 || (d[0] & 0xffff) >= MAX_CPUS )
+                return -1;
+            cpu = d[0] & 0xffff;
+            break;
+        case TRC_LOST_RECORDS:
+            lost++;
+            break;
+        default:
+            handle(cpu, event, tsc_to_ns(cpus[cpu].tsc), d, n);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int vstat_cmp(const void *a, const void *b)
+{
+    const struct vstat *x = *(const struct vstat **)a;
+    const struct vstat *y = *(const struct vstat **)b;
+
+    if ( x->domid != y->domid )
+        return x->domid < y->domid ? -1 : 1;
+    return x->vcpuid < y->vcpuid ? -1 : x->vcpuid > y->vcpuid;
+}
+
+static void report(void)
+{
+    struct vstat **all, *v;
+    unsigned int i, b;
+
+    printf("boundaries         %lu\n", boundaries);
+    printf("slice_us_avg       %"PRIu64"\n",
+           boundaries ? boundary_ns / boundaries / 1000 : 0);
+    printf("repartitions       %lu\n", repartitions);
+    printf("moved_vcpus        %lu of %lu, at most %lu at once\n",
+           moved, moved_of, moved_max);
+    printf("refused_requests   %lu\n", refused);
+    if ( lost )
+        printf("lost_records       %lu\n", lost);
+
+    all = calloc(nr_vstats ? nr_vstats : 1, sizeof(*all));
+    if ( all == NULL )
+    {
+        perror("calloc");
+        exit(1);
+    }
+    for ( i = 0, b = 0; b < VSTAT_BUCKETS; b++ )
+        for ( v = vstats[b]; v != NULL; v = v->next )
+            all[i++] = v;
+    qsort(all, nr_vstats, sizeof(*all), vstat_cmp);
+
+    printf("\n%10s %8s %10s %10s %5s %7s %8s %8s %6s %8s %8s %8s %8s %5s\n",
+           "vcpu", "slices", "budget_us", "ran_us", "used%", "exhaust",
+           "ovr_avg", "ovr_max", "skips", "skip_max", "arrivals", "lat_avg",
+           "lat_max", "migr");
+    for ( i = 0; i < nr_vstats; i++ )
+    {
+        v = all[i];
+        printf("%6u.%-3u %8lu %10"PRIu64" %10"PRIu64" %5.1f %7lu %8"PRIu64
+               " %8"PRIu64" %6lu %8"PRIu64" %8lu %8"PRIu64" %8"PRIu64" %5lu\n",
+               v->domid, v->vcpuid, v->slices, v->budget / 1000, v->ran / 1000,
+               v->budget ? 100.0 * v->ran / v->budget : 0.0,
+               v->exhausted,
+               v->exhausted ? v->overrun / v->exhausted / 1000 : 0,
+               v->overrun_max / 1000,
+               v->skips, v->skip_max / 1000,
+               v->arrivals,
+               v->latencies ? v->lat_sum / v->latencies / 1000 : 0,
+               v->lat_max / 1000,
+               v->migrations);
+    }
+
+    free(all);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *f;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "m:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'm': cpu_mhz = strtoull(optarg, NULL, 0); break;
+        default: goto usage;
+        }
+    }
+
+    if ( optind + 1 != argc || cpu_mhz == 0 )
+        goto usage;
+
+    f = fopen(argv[optind], "rb");
+    if ( f == NULL )
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    if ( read_trace(f) )
+        fprintf(stderr, "%s: truncated record, summary covers what came "
+                "before it\n", argv[optind]);
+    fclose(f);
+
+    report();
+    return 0;
+
+ usage:
+    fprintf(stderr, "usage: %s [-m cpu-mhz] trace-file\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,206 @@
+/******************************************************************************
+ * Global state behind the Xen shim used by the RTVirt simulator
+ ******************************************************************************/
+
+#include <stdarg.h>
+#include <xen/sim-shim.h>
+#include "sim.h"
+
+s_time_t sim_now;
+int sim_cpu;
+int sim_verbose;
+unsigned int nr_cpu_ids;
+cpumask_t cpu_online_map;
+struct vcpu *idle_vcpu[NR_CPUS];
+struct schedule_data sim_percpu_schedule_data[NR_CPUS];
+struct cpupool *sim_percpu_cpupool[NR_CPUS];
+cpumask_var_t sim_percpu_cpu_sibling_mask[NR_CPUS];
+cpumask_var_t sim_percpu_cpu_core_mask[NR_CPUS];
+static cpumask_t sim_sibling_masks[NR_CPUS], sim_core_masks[NR_CPUS];
+unsigned char sim_softirq_pending[NR_CPUS];
+unsigned long sim_ipis;
+unsigned long sim_virqs;
+
+static struct list_head sim_tasklets = { &sim_tasklets, &sim_tasklets };
+
+int tb_init_done;
+static FILE *sim_trace_file;
+static int sim_trace_cpu = -1;
+
+/* Owned by schedule.c in the hypervisor. */
+int sc_debugging = 3;
+
+int sim_printk(const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    if ( !sim_verbose )
+        return 0;
+
+    va_start(args, fmt);
+    ret = vfprintf(stderr, fmt, args);
+    va_end(args);
+
+    return ret;
+}
+
+void sim_bug(const char *file, int line)
+{
+    fprintf(stderr, "BUG at %s:%d (t=%"PRIi64")\n", file, line, sim_now);
+    abort();
+}
+
+/* Like Xen, only a softirq raised on another CPU not pending yet is an IPI */
+void sim_raise_softirq(unsigned int cpu)
+{
+    if ( cpu >= nr_cpu_ids || sim_softirq_pending[cpu] )
+        return;
+
+    sim_softirq_pending[cpu] = 1;
+    if ( cpu != sim_cpu )
+        sim_ipis++;
+}
+
+void send_guest_global_virq(struct domain *d, uint32_t virq)
+{
+    sim_virqs++;
+}
+
+void sim_raise_softirq_mask(const cpumask_t *mask)
+{
+    int cpu;
+
+    for_each_cpu ( cpu, mask )
+        sim_raise_softirq(cpu);
+}
+
+/*
+ * Spread nr_cpus CPUs over llcs last-level caches, threads SMT threads per
+ * core, with one package (cpu_core_mask) per LLC. Cores are numbered
+ * round-robin over the LLCs, the way firmware usually enumerates a
+ * multi-socket host, so core n and n + 1 never share one unless there is a
+ * single LLC. As on x86, the second thread of every core is numbered after
+ * the first thread of all of them, so siblings are never adjacent either.
+ */
+void sim_topology(int nr_cpus, int llcs, int threads)
+{
+    int nr_cores = nr_cpus / threads, cpu, other;
+
+    for ( cpu = 0; cpu < NR_CPUS; cpu++ )
+    {
+        cpumask_clear(&sim_sibling_masks[cpu]);
+        cpumask_clear(&sim_core_masks[cpu]);
+        per_cpu(cpu_sibling_mask, cpu) = &sim_sibling_masks[cpu];
+        per_cpu(cpu_core_mask, cpu) = &sim_core_masks[cpu];
+        cpumask_set_cpu(cpu, &sim_sibling_masks[cpu]);
+
+        for ( other = 0; other < nr_cpus; other++ )
+        {
+            if ( other % nr_cores == cpu % nr_cores )
+                cpumask_set_cpu(other, &sim_sibling_masks[cpu]);
+            if ( other % nr_cores % llcs == cpu % nr_cores % llcs )
+                cpumask_set_cpu(other, &sim_core_masks[cpu]);
+        }
+    }
+}
+
+void tasklet_init(struct tasklet *t, void (*func)(unsigned long),
+                  unsigned long data)
+{
+    memset(t, 0, sizeof(*t));
+    t->scheduled_on = -1;
+    t->func = func;
+    t->data = data;
+}
+
+void tasklet_schedule_on_cpu(struct tasklet *t, unsigned int cpu)
+{
+    if ( t->scheduled_on >= 0 )
+        return;
+    t->scheduled_on = cpu;
+    list_add_tail(&t->list, &sim_tasklets);
+}
+
+void tasklet_kill(struct tasklet *t)
+{
+    if ( t->scheduled_on < 0 )
+        return;
+    list_del(&t->list);
+    t->scheduled_on = -1;
+}
+
+void sim_run_tasklets(void)
+{
+    struct tasklet *t;
+
+    while ( !list_empty(&sim_tasklets) )
+    {
+        t = list_entry(sim_tasklets.next, struct tasklet, list);
+        list_del(&t->list);
+        sim_cpu = t->scheduled_on;
+        t->scheduled_on = -1;
+        t->func(t->data);
+    }
+}
+
+/*
+ * Write records the way xentrace lays out its output: a TRC_TRACE_CPU_CHANGE
+ * record whenever the CPU changes, then the records themselves with the
+ * simulated time in ns standing in for the TSC. The byte count of the CPU
+ * change record is left at 0, since records are written as they happen
+ * rather than a buffer at a time.
+ */
+#define TRC_TRACE_CPU_CHANGE  0x0001f003
+#define TRACE_EXTRA_SHIFT     28
+#define TRACE_CYCLES          (1U << 31)
+
+int sim_trace_open(const char *path)
+{
+    sim_trace_file = fopen(path, "wb");
+    if ( sim_trace_file == NULL )
+        return -1;
+
+    tb_init_done = 1;
+    return 0;
+}
+
+void sim_trace_close(void)
+{
+    if ( sim_trace_file != NULL )
+        fclose(sim_trace_file);
+    sim_trace_file = NULL;
+    tb_init_done = 0;
+}
+
+void __trace_var(uint32_t event, bool_t cycles, unsigned int extra,
+                 const void *extra_data)
+{
+    uint32_t rec[3 + 7];
+    unsigned int n = 0, words = extra / sizeof(uint32_t);
+
+    if ( sim_trace_file == NULL || words > 7 )
+        return;
+
+    if ( sim_cpu != sim_trace_cpu )
+    {
+        uint32_t change[3];
+
+        change[0] = TRC_TRACE_CPU_CHANGE | (2U << TRACE_EXTRA_SHIFT);
+        change[1] = sim_cpu;
+        change[2] = 0;
+        fwrite(change, sizeof(change), 1, sim_trace_file);
+        sim_trace_cpu = sim_cpu;
+    }
+
+    rec[n++] = event | (words << TRACE_EXTRA_SHIFT) | (cycles ? TRACE_CYCLES : 0);
+    if ( cycles )
+    {
+        rec[n++] = (uint32_t)sim_now;
+        rec[n++] = (uint32_t)((uint64_t)sim_now >> 32);
+    }
+    memcpy(&rec[n], extra_data, extra);
+    n += words;
+
+    fwrite(rec, sizeof(uint32_t), n, sim_trace_file);
+}
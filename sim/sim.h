@@ -0,0 +1,18 @@
+/******************************************************************************
+ * Simulator-private declarations shared by the shim and the driver
+ ******************************************************************************/
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+extern int sim_verbose;
+extern unsigned char sim_softirq_pending[NR_CPUS];
+extern unsigned long sim_ipis;
+extern unsigned long sim_virqs;
+
+void sim_run_tasklets(void);
+void sim_topology(int nr_cpus, int llcs, int threads);
+int sim_trace_open(const char *path);
+void sim_trace_close(void);
+
+#endif /* __SIM_H__ */